@@ -11,15 +11,34 @@
  * 
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#ifndef LISP_LIBRARY
 #include <readline/readline.h>
 #include <readline/history.h>
+#endif
 #include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <ucontext.h>
+#include <time.h>
 #include "mpc.h"
+#include "lisp.h"
 
 /**
  * @brief Debug logging macro.
@@ -61,8 +80,15 @@
 
 typedef struct lval lval_t;
 typedef struct lenv lenv_t;
+typedef struct lfile lfile_t;
+typedef struct lstrbuf lstrbuf_t;
+typedef struct ltrie ltrie_t;
+typedef struct linterp linterp_t;
+typedef struct lfuture lfuture_t;
+typedef struct lmailbox lmailbox_t;
+typedef struct lcoro lcoro_t;
 
-typedef enum var_types {LVAL_NUM, LVAL_FLOAT, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_STR} var_t; //Enum for different operand types. 
+typedef enum var_types {LVAL_NUM, LVAL_FLOAT, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_STR, LVAL_FILE, LVAL_FUTURE, LVAL_ISOLATE, LVAL_TASK, LVAL_GEN} var_t; //Enum for different operand types. 
 
 typedef lval_t*(*lbuiltin)(lenv_t*, lval_t*);
 
@@ -71,9 +97,26 @@ struct lenv {
     int count;
     char** syms;
     lval_t** vals;
+    ltrie_t* trie; //Prefix index of bound symbols for completion, kept by the root environment only.
+    int boundary; //If set, def binds here instead of in parents (connection environments of the server).
+    linterp_t* interp; //Interpreter the environment belongs to, set for every environment code is evaluated in.
+    pthread_rwlock_t* lock; //Set for global environment only, which futures read while its thread defines.
+};
+
+/**
+ * @brief
+ * Node of prefix trie of symbol names. Children of a node are a list of siblings sorted by character,
+ * end tells that a symbol ends at this node.
+*/
+struct ltrie {
+    ltrie_t* kids;
+    ltrie_t* next;
+    char c;
+    int end;
 };
 struct lval {
     var_t type;
+    uint32_t src_pos; //Byte offset of the value in its source file, fits into alignment padding after type.
     
     union {
         long num;
@@ -82,20 +125,467 @@ struct lval {
         char* sym;
         char* str;
         lbuiltin builtin;
+        lfile_t* file;
+        lfuture_t* future;
+        lmailbox_t* mailbox;
+        lcoro_t* task;
+        lcoro_t* gen;
     };
 
-    lenv_t* env;
-    lval_t* formals;
-    lval_t* body;
+    union {
+        struct { //Lambda.
+            lenv_t* env;
+            lval_t* formals;
+            lval_t* body;
+        };
+        struct { //String: buffer str points into (NULL if str is owned and NUL-terminated) and length.
+            lstrbuf_t* owner;
+            size_t len;
+        };
+    };
 
     int count;
+    uint32_t src_file; //Source file id (see lsrc_register), 0 if value wasn't read from a file.
     struct lval** cell;
+    int refs; //0 for ordinary values, which have one owner. Frozen values are immutable and shared, this counts holders.
 };
 
 typedef enum err_types {LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM} err_t;
 
+/**
+ * @brief
+ * Growable byte buffer. Used for building binary encodings without many small allocations.
+*/
+typedef struct lbuf {
+    char* data;
+    size_t len;
+    size_t cap;
+} lbuf_t;
+
+/**
+ * @brief
+ * Interpreter: grammar, global environment and output. Interpreters share nothing but the
+ * source file table (which is locked), so independent ones may run on different threads at once.
+ * Environments point to their interpreter, this is how builtins reach it.
+*/
+struct linterp {
+    mpc_parser_t* Number;
+    mpc_parser_t* Float;
+    mpc_parser_t* String;
+    mpc_parser_t* Symbol;
+    mpc_parser_t* Comment;
+    mpc_parser_t* Sexpr;
+    mpc_parser_t* Qexpr;
+    mpc_parser_t* Expr;
+    mpc_parser_t* TinyLisp;
+    lenv_t* env; //Global environment.
+    lbuf_t out; //Output buffer, written to out_file at flush points or when full.
+    FILE* out_file;
+    int out_capture; //While set, output is kept in out for the caller instead of being written.
+    lmailbox_t* mailbox; //Messages sent to the interpreter, Isolate values refer to it.
+    struct ljob* futures; //Futures still evaluating in the global environment, shared with copies made by future.
+};
+
+/**
+ * @brief
+ * Header of a precompiled source cache file (<source>.tlc) written by builtin_load.
+ * The cache is valid only while size, mtime and content hash of the source all match.
+*/
+typedef struct lcache_hdr {
+    char magic[4];
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+} lcache_hdr_t;
+
+#define LOUT_FLUSH_SIZE (64 << 10)
+#define LFILE_BUF_SIZE (64 << 10)
+#define LSTR_PIN_MIN (1 << 20)
+#define LSTR_PIN_RATIO 64
+
+/**
+ * @brief
+ * Shared buffer string slices point into: mmapped file or heap memory of a former string.
+ * Slices are not NUL-terminated; the buffer lives while any slice refers to it.
+*/
+struct lstrbuf {
+    int refs;
+    int mapped;
+    char* data;
+    size_t size;
+};
+
+/**
+ * @brief
+ * Buffered file handle. File values share it, so copying a File value copies the handle, not the file;
+ * the file is closed by close or when the last value referring to it is deleted.
+ * The buffer holds unread input of a readable file, or unwritten output of a writable one.
+ * Values may reach other threads (pmap, future, spawn), so every operation holds lock (see lfile_lock).
+*/
+struct lfile {
+    int fd;
+    int refs;
+    int writable;
+    int eof;
+    int err; //errno of the read which failed, reported instead of end of file.
+    char* path;
+    char* buf;
+    size_t pos;
+    size_t len;
+    size_t cap;
+    pthread_mutex_t lock;
+    struct lloop* holder; //Event loop whose coroutine holds lock, it may be waiting in that loop.
+    struct lcoro* waiters; //Coroutines of that loop waiting for lock, chained by wnext.
+};
+
+/**
+ * @brief
+ * Limits of printing used by the REPL and print: maximal number of shown list elements and list nesting.
+*/
+typedef struct lprint_opts {
+    long length;
+    long depth;
+} lprint_opts_t;
+
+/**
+ * @brief
+ * List (or lambda) being printed by lval_print_opts and index of its next element.
+*/
+typedef struct lprint_frame {
+    lval_t* v;
+    int i;
+} lprint_frame_t;
+
+#define LCACHE_MAGIC "TLC\0"
+#define LCACHE_VERSION 3
+#define LCACHE_EXT ".tlc"
+#ifdef __APPLE__
+#define LSTAT_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#else
+#define LSTAT_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#endif
+
+#define LLOAD_PARALLEL_MIN (1 << 20)
+#define LLOAD_CHUNK_MIN (256 << 10)
+#define LLOAD_MAX_THREADS 64
+#define LSTREAM_READ_SIZE (1 << 20)
+#define LSERVE_MAX_REQUEST (64 << 20)
+#define LFORK_MAX_WORKERS 1024
+#define LSERVE_MAX_PENDING (16 << 20)
+#define LSERVE_READ_SIZE (64 << 10)
+
+#define LCORO_STACK_SIZE (8 << 20)
+#define LLOOP_MAX_EVENTS 64
+
+#define LPOOL_MAX_WORKERS 64
+#define LPMAP_MIN 16
+#define LPMAP_CHUNKS_PER_THREAD 4
+
+/**
+ * @brief
+ * Unit of work of the thread pool.
+*/
+typedef struct ltask {
+    void (*run)(void* arg);
+    void* arg;
+} ltask_t;
+
+/**
+ * @brief
+ * Tasks queued on one pool worker, kept in tasks[top, bottom). The worker takes the newest task
+ * from the bottom, idle threads steal the oldest from the top.
+*/
+typedef struct ldeque {
+    pthread_mutex_t lock;
+    ltask_t* tasks;
+    size_t top;
+    size_t bottom;
+    size_t cap;
+} ldeque_t;
+
+/**
+ * @brief
+ * Work-stealing thread pool shared by the whole process, started on first use with a worker per CPU
+ * (or LISP_THREADS) but one, as the thread waiting for a job runs its tasks too. Idle workers sleep on wake while queued is 0.
+*/
+typedef struct lpool {
+    int nworkers;
+    ldeque_t* deques;
+    long queued;
+    unsigned next;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} lpool_t;
+
+/**
+ * @brief
+ * Group of tasks somebody waits for. Every task calls ljob_finish once.
+*/
+typedef struct ljob {
+    int remaining;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} ljob_t;
+
+/**
+ * @brief
+ * Part of list mapped by pmap as one task: elements [start, end) of in are mapped to out.
+ * Everything printed by it is kept in output, so output of all parts can be written in list order.
+*/
+typedef struct lpmap_chunk {
+    lenv_t* env;
+    lval_t* fn;
+    lval_t** in;
+    lval_t** out;
+    int start;
+    int end;
+    lbuf_t output;
+    ljob_t* job;
+} lpmap_chunk_t;
+
+/**
+ * @brief
+ * Evaluation started by future, shared by its Future values like File values share lfile.
+ * The pool task evaluates expr in env, which holds copies of the caller's local bindings over the global
+ * environment, then stores result and finishes job. Output is captured by interp until the first await.
+*/
+struct lfuture {
+    int refs;
+    int started; //Set by whoever evaluates the expression: the pool task or an await that comes first.
+    int printed;
+    lval_t* expr;
+    lenv_t* env;
+    linterp_t interp;
+    lval_t* result;
+    ljob_t job;
+};
+
+/**
+ * @brief
+ * Message in mailbox. The mailbox keeps a stub message, so its queue is never empty.
+*/
+typedef struct lmsg {
+    struct lmsg* next;
+    lval_t* v;
+} lmsg_t;
+
+/**
+ * @brief
+ * Mailbox of interpreter, a lock-free queue with many senders and one receiver. Senders swap their message
+ * into head and then link it from the previous one, the receiver takes messages from tail. The lock and
+ * wake are used only to sleep in receive while sleeping is set. Isolate values share it like File values share lfile.
+*/
+struct lmailbox {
+    int refs;
+    int receiving;
+    int sleeping;
+    lmsg_t* head;
+    lmsg_t* tail;
+    lmsg_t stub;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+typedef enum lcoro_states {LCORO_READY, LCORO_WAITING, LCORO_RUNNING, LCORO_DONE} lcoro_state_t;
+
+/**
+ * @brief
+ * Coroutine started by async: expression evaluated on its own stack, which gives way to other coroutines of
+ * its thread while it waits for I/O, sleep or another coroutine. Task values share it like File values share lfile.
+ * next links it into the ready queue or the sleepers of its loop, waiters are coroutines waiting for it (linked by wnext).
+ * Generators are coroutines too, resumed by next instead of a loop; they switch back to back and keep yielded value in result.
+*/
+struct lcoro {
+    int refs;
+    lcoro_state_t state;
+    ucontext_t ctx;
+    char* stack;
+    lenv_t* env;
+    lval_t* expr;
+    lval_t* result;
+    struct lloop* loop;
+    long long wake_at;
+    lcoro_t* next;
+    lcoro_t* waiters;
+    lcoro_t* wnext;
+    ucontext_t* back;
+    pthread_t thread; //Thread generator was made on, its stack may only be resumed there.
+    int cancel; //Set when a paused generator is dropped: it is resumed once more with yield failing, to unwind.
+};
+
+/**
+ * @brief
+ * Event loop of a thread: coroutines ready to run, sleeping ones (by wake_at), and epoll instance
+ * coroutines waiting for file descriptors are registered in. It runs inside await-io called outside coroutines.
+*/
+typedef struct lloop {
+    ucontext_t main;
+    lcoro_t* current;
+    lcoro_t* ready;
+    lcoro_t* ready_tail;
+    lcoro_t* sleepers;
+    int epfd;
+    int waiting_io;
+} lloop_t;
+
+/**
+ * @brief
+ * Interpreter of a new isolate and expression its thread evaluates.
+*/
+typedef struct lisolate {
+    linterp_t* interp;
+    lval_t* expr;
+} lisolate_t;
+
+/**
+ * @brief
+ * Client connection of the evaluation server. Requests are read into in and answered into out,
+ * sent bytes of out are skipped until everything is written. Every connection has its own environment
+ * whose parent is the shared global one.
+*/
+typedef struct lconn {
+    int fd;
+    lenv_t* env;
+    lbuf_t in;
+    lbuf_t out;
+    size_t sent;
+} lconn_t;
+
+/**
+ * @brief
+ * Incremental scanner of top-level form boundaries. Knows just enough of the grammar
+ * (brackets, strings with escapes, ; comments) to tell where one top-level form may end and the next begin,
+ * without parsing. State carries over between lscan_feed calls, so input can be fed piece by piece.
+*/
+typedef struct lscan {
+    long depth;
+    int in_str;
+    int escape;
+    int in_comment;
+} lscan_t;
+
+/**
+ * @brief
+ * One part of a file parsed on its own thread by lval_parse_source.
+*/
+typedef struct lparse_job {
+    linterp_t* interp;
+    const char* path;
+    char* src;
+    size_t base;
+    uint32_t file;
+    lval_t* forms;
+} lparse_job_t;
+
+/**
+ * @brief
+ * File given on the command line with --parallel-parse, read by a pool task while other files are read.
+ * forms is NULL for arguments which are not files.
+*/
+typedef struct lpreload {
+    linterp_t* interp;
+    const char* path;
+    lval_t* forms;
+    ljob_t* job;
+} lpreload_t;
+
+/**
+ * @brief
+ * Source file known to the reader. Values keep only file id and byte offset,
+ * line starts are kept here to turn offsets into line and column when needed.
+*/
+typedef struct lsrc_file {
+    char* name;
+    uint64_t key; //Hash of name and contents, 0 once the file grows piece by piece, then it is never reused.
+    size_t size;
+    uint32_t* lines;
+    uint32_t nlines;
+    uint32_t cap;
+    uint32_t id; //Id of the file, a ring slot of lsrc_register_text is reused under a new one.
+} lsrc_file_t;
+
+#define LSRC_TEXTS 1024 //Ring slots for short-lived texts: REPL entries, -e, requests and lisp_eval.
+#define LSRC_TEXT_ID 0x80000000u //Ids of ring texts have this bit set, files registered for good don't.
+
+/**
+ * @brief
+ * Column collected by read-csv: fields are NUL-terminated strings inside the file buffer.
+*/
+typedef struct lcsv_col {
+    char** fields;
+    size_t count;
+    size_t cap;
+} lcsv_col_t;
+
+#define LJSON_MAX_DEPTH 512
+
+/**
+ * @brief
+ * State of JSON reader. Values are built directly while reading, without any intermediate tree.
+*/
+typedef struct ljson {
+    const char* start;
+    const char* p;
+    const char* err;
+    int depth;
+} ljson_t;
+
+#define LSER_MAGIC "TLS"
+#define LSER_VERSION 2
+#define LSER_FLAG_POS 0x01
+#define LSER_TAG_REF 0x40
+#define LSER_MIN_SHARED_STR 4
+#define LSER_MAX_DEPTH 4096
+
+/**
+ * @brief
+ * Entry of encoder table of already written values, used to emit references to repeated subtrees.
+*/
+typedef struct lshared {
+    uint64_t hash;
+    lval_t* node;
+    uint32_t id;
+} lshared_t;
+
+/**
+ * @brief
+ * State of binary encoder (lval_dump). Hashes and subtree sizes are precomputed for every node in write order.
+*/
+typedef struct ldump {
+    lbuf_t* buf;
+    lenv_t* env;
+    int with_pos;
+    uint64_t* hashes;
+    int* sizes;
+    int count;
+    int cap;
+    int cursor;
+    lshared_t* shared;
+    int shared_count;
+    int shared_cap;
+    lval_t* err;
+} ldump_t;
+
+/**
+ * @brief
+ * State of binary decoder (lval_undump). Keeps every decoded shared value so references can copy it.
+*/
+typedef struct lundump {
+    const unsigned char* p;
+    const unsigned char* end;
+    lenv_t* env;
+    uint32_t file;
+    lval_t** shared;
+    uint64_t shared_count;
+    uint64_t shared_cap;
+    int depth;
+} lundump_t;
+
 lval_t* lval_eval_sexpr(lenv_t* e, lval_t* v);
 lval_t* lval_eval(lenv_t* e, lval_t* v);
+lval_t* lval_alloc(void);
 lval_t *lval_num(long x);
 lval_t *lval_float(double x);
 lval_t* lval_err(char* fmt, ...);
@@ -104,6 +594,12 @@ lval_t* lval_sexpr(void);
 lval_t* lval_qexpr(void);
 lval_t* lval_fun(lbuiltin func);
 lval_t* lval_str(char* s);
+lval_t* lval_str_own(char* s);
+lval_t* lval_str_len(const char* s, size_t n);
+lval_t* lval_slice(lstrbuf_t* owner, char* s, size_t n);
+char* lval_str_cstr(lval_t* v);
+void lval_unpin(lval_t* v);
+void lstrbuf_release(lstrbuf_t* b);
 lval_t* lval_lambda(lval_t* formals, lval_t* body);
 lval_t* lval_call(lenv_t* e, lval_t* f, lval_t* a);
 int lval_eq(lval_t* x, lval_t* y);
@@ -146,106 +642,350 @@ lval_t* builtin_error(lenv_t* e, lval_t* a);
 
 lval_t* lval_join(lval_t* x, lval_t* y);
 lval_t* lval_copy(lval_t* v);
+static lval_t* lval_dup(lval_t* v);
+lval_t* lval_thaw(lval_t* v);
+static inline int lval_frozen(lval_t* v);
+void lval_freeze(lval_t* v);
+
+void lbuf_init(lbuf_t* b);
+void lbuf_reserve(lbuf_t* b, size_t n);
+void lbuf_putc(lbuf_t* b, char c);
+void lbuf_append(lbuf_t* b, const void* data, size_t n);
+void lbuf_free(lbuf_t* b);
+
+void lout_putc(linterp_t* it, char c);
+void lout_write(linterp_t* it, const char* s, size_t n);
+void lout_puts(linterp_t* it, const char* s);
+void lout_printf(linterp_t* it, const char* fmt, ...);
+void lout_flush(linterp_t* it);
+
+void lbin_put_uvarint(lbuf_t* b, uint64_t x);
+int lbin_get_uvarint(const unsigned char** p, const unsigned char* end, uint64_t* x);
+int lval_dump(ldump_t* d, lval_t* v);
+lval_t* lval_undump(lundump_t* u);
+static lval_t* lval_undump_value(lundump_t* u, int type);
+lval_t* lval_serialize(lbuf_t* b, lenv_t* e, lval_t* v, int with_pos);
+lval_t* lval_deserialize(const char* data, size_t n, lenv_t* e, uint32_t file);
+lval_t* builtin_serialize(lenv_t* e, lval_t* a);
+lval_t* builtin_read_csv(lenv_t* e, lval_t* a);
+lval_t* builtin_json_parse(lenv_t* e, lval_t* a);
+lval_t* builtin_json_write(lenv_t* e, lval_t* a);
+
+lval_t* lval_file(lfile_t* f);
+lfile_t* lfile_open(const char* path, const char* mode);
+int lfile_close(lfile_t* f);
+void lfile_release(lfile_t* f);
+char* lfile_read_line(lfile_t* f, size_t* n);
+int lfile_write(lfile_t* f, const char* data, size_t n);
+static void lfile_lock(lfile_t* f);
+static void lfile_unlock(lfile_t* f);
+lval_t* builtin_open(lenv_t* e, lval_t* a);
+lval_t* builtin_read_line(lenv_t* e, lval_t* a);
+lval_t* builtin_read_bytes(lenv_t* e, lval_t* a);
+lval_t* builtin_write(lenv_t* e, lval_t* a);
+lval_t* builtin_close(lenv_t* e, lval_t* a);
+lval_t* builtin_for_each_line(lenv_t* e, lval_t* a);
+lval_t* builtin_mmap_file(lenv_t* e, lval_t* a);
+lval_t* builtin_substr(lenv_t* e, lval_t* a);
+lval_t* builtin_str_len(lenv_t* e, lval_t* a);
+lval_t* builtin_str_find(lenv_t* e, lval_t* a);
+
+lpool_t* lpool_get(void);
+void lpool_submit(ltask_t t);
+int lpool_take(ltask_t* t);
+void ljob_init(ljob_t* j, int n);
+void ljob_finish(ljob_t* j);
+void ljob_wait(ljob_t* j);
+void ljob_block(ljob_t* j);
+void ljob_destroy(ljob_t* j);
+void lfork_reset(void);
+lval_t* lval_pmap(lenv_t* e, lval_t* a, char* func);
+lval_t* builtin_pmap(lenv_t* e, lval_t* a);
+lval_t* builtin_pfor_each(lenv_t* e, lval_t* a);
+void lfuture_release(lfuture_t* f);
+lmailbox_t* lmailbox_new(void);
+void lmailbox_release(lmailbox_t* m);
+static void lenv_put_self(linterp_t* it);
+void lmailbox_send(lmailbox_t* m, lval_t* v);
+lval_t* lmailbox_receive(lmailbox_t* m, long ms);
+lval_t* builtin_spawn(lenv_t* e, lval_t* a);
+lval_t* builtin_send(lenv_t* e, lval_t* a);
+lval_t* builtin_receive(lenv_t* e, lval_t* a);
+lval_t* builtin_freeze(lenv_t* e, lval_t* a);
+void lcoro_release(lcoro_t* c);
+static void lio_wait(int fd, uint32_t events);
+lval_t* builtin_async(lenv_t* e, lval_t* a);
+lval_t* builtin_await_io(lenv_t* e, lval_t* a);
+lval_t* builtin_sleep(lenv_t* e, lval_t* a);
+lval_t* builtin_gen(lenv_t* e, lval_t* a);
+lval_t* builtin_yield(lenv_t* e, lval_t* a);
+lval_t* builtin_next(lenv_t* e, lval_t* a);
+lval_t* builtin_future(lenv_t* e, lval_t* a);
+lval_t* builtin_await(lenv_t* e, lval_t* a);
+lval_t* ljson_read(ljson_t* j);
+int ljson_write(lbuf_t* b, lval_t* v);
+lval_t* builtin_deserialize(lenv_t* e, lval_t* a);
+
+uint64_t lhash_bytes(const char* data, size_t n);
+char* lfile_read_all(const char* path, size_t* size);
+void lscan_init(lscan_t* s);
+size_t lscan_feed(lscan_t* s, const char* buf, size_t n);
+lval_t* lval_parse_string(linterp_t* it, const char* name, const char* src, uint32_t file, size_t base);
+static void lparse_err_locate(mpc_err_t* err, uint32_t file, size_t base);
+lval_t* lval_parse_source(linterp_t* it, const char* path, const char* contents, size_t size, uint32_t file, int threads);
+lval_t* lval_read_file(linterp_t* it, const char* path, int threads);
+void lval_eval_forms(lenv_t* e, lval_t* forms);
+void lval_eval_print(lenv_t* e, lval_t* forms);
+lval_t* lval_parse_text(linterp_t* it, const char* name, const char* src, uint32_t file, size_t base);
+int lval_run_stream(lenv_t* e, int fd, const char* name);
+void lval_eval_line(lenv_t* e, const char* name, const char* line, uint32_t file, size_t base);
+int lval_run_batch(lenv_t* e, const char* path, int workers);
+int lserve_listen(const char* path);
+int lserve_handle(lconn_t* c);
+int lval_serve(lenv_t* e, const char* path, int workers);
+
+lval_t* lcache_load(const char* path, struct stat* st, uint64_t hash, uint32_t file);
+void lcache_store(const char* path, struct stat* st, uint64_t hash, lval_t* forms);
 
 lenv_t* lenv_new(void);
+linterp_t* linterp_new(void);
+void linterp_del(linterp_t* it);
 void lenv_del(lenv_t* e);
 lval_t* lenv_get(lenv_t* e, lval_t* k);
+long lenv_get_num(lenv_t* e, char* sym, long dflt);
+lenv_t* lenv_snapshot(lenv_t* e);
 void lenv_put(lenv_t* e, lval_t* k, lval_t* v);
 void lenv_add_builtin(lenv_t* e, char* name, lbuiltin func);
 void lenv_add_builtins(lenv_t* e);
 lenv_t* lenv_copy(lenv_t* e);
 void lenv_def(lenv_t* e, lval_t* k, lval_t* v);
 
-void lval_print(lval_t* res);
-void lval_println(lval_t* res);
-void lval_print_str(lval_t* v);
+ltrie_t* ltrie_new(void);
+void ltrie_free(ltrie_t* t);
+void ltrie_insert(ltrie_t* t, const char* s);
+char** ltrie_complete(ltrie_t* t, const char* prefix, int* count);
+
+void lval_print(linterp_t* it, lval_t* res);
+void lval_println(linterp_t* it, lval_t* res);
+void lval_print_opts(linterp_t* it, lval_t* res, lprint_opts_t* o);
+void lval_println_opts(linterp_t* it, lval_t* res, lprint_opts_t* o);
+void lprint_opts_get(lenv_t* e, lprint_opts_t* o);
+void lval_print_str(linterp_t* it, lval_t* v);
 void lval_del(lval_t* v);
 
 lval_t* lval_read_num(mpc_ast_t* t);
 lval_t* lval_read_float(mpc_ast_t* t);
 lval_t* lval_read_str(mpc_ast_t* t);
 lval_t* lval_read(mpc_ast_t* t);
+lval_t* lval_read_src(mpc_ast_t* t, uint32_t file, size_t base);
+
+uint32_t lsrc_register(const char* name, const char* contents, size_t size);
+uint32_t lsrc_register_text(const char* name, const char* contents, size_t size);
+static void lsrc_add_lines(lsrc_file_t* f, const char* text, size_t n, size_t base);
+void lsrc_append(uint32_t file, const char* text, size_t n, size_t base);
+int lsrc_locate(uint32_t file, uint32_t pos, char** name, long* line, long* col);
+lval_t* lval_locate(lval_t* v, uint32_t file, uint32_t pos);
 lval_t* lval_add(lval_t* v, lval_t* x);
 lval_t* lval_pop(lval_t* v, int i);
 lval_t* lval_take(lval_t* v, int i);
 
-void lval_expr_print(lval_t* v, char open, char close);
 long ipow(long base, int exp);
 
 char* ltype_name(int t);
 
-mpc_parser_t* Number;
-mpc_parser_t* Float;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* TinyLisp;
+/* Command line program, left out of the library build */
+#ifndef LISP_LIBRARY
 
-int main(int argc, char** argv) {
+lenv_t* lrepl_env = NULL; //Environment whose symbols the REPL completes.
 
-    //Telling parser what it can parse. 
-    Number   = mpc_new("number");
-    Float    = mpc_new("float");
-    String   = mpc_new("string");
-    Symbol   = mpc_new("symbol");
-    Comment  = mpc_new("comment");
-    Sexpr    = mpc_new("sexpr");
-    Qexpr    = mpc_new("qexpr");
-    Expr     = mpc_new("expr");
-    TinyLisp = mpc_new("tinylisp");
+//This function hands out completions of text one by one to readline, which frees them.
+static char* lrepl_complete_next(const char* text, int state) {
+    static char** matches = NULL;
+    static int next = 0;
+    if (state == 0) {
+        int count;
+        free(matches);
+        matches = ltrie_complete(lrepl_env->trie, text, &count);
+        next = 0;
+    }
+    return matches ? matches[next++] : NULL;
+}
 
-    //Defining Lisp grammar. 
-    mpca_lang(MPCA_LANG_DEFAULT,
-    "                                                                     \
-        number   : /-?[0-9]+/ ;                                            \
-        float    : /-?[0-9]+[.][0-9]+/ ;                                    \
-        string   : /\"(\\\\.|[^\"])*\"/ ;                                     \
-        symbol   : /[a-zA-Z0-9_+\\-*\\/\\^\\*\\\\\\=<>!&]+/ ;                    \
-        comment  : /;[^\\r\\n]*/ ;                                               \
-        sexpr    : '(' <expr>* ')' ;                                          \
-        qexpr    : '{' <expr>* '}' ;                                             \
-        expr     : <float> | <number> | <string> | <symbol> | <sexpr> | <qexpr> | <comment> ;          \
-        tinylisp : /^/ <expr>* /$/ ;                                             \
-    ",
-    Number, Float, String, Symbol, Comment, Sexpr, Qexpr, Expr, TinyLisp);
+//This function completes symbol under cursor from the environment's trie instead of file names.
+char** lrepl_complete(const char* text, int start, int end) {
+    (void)start;
+    (void)end;
+    rl_attempted_completion_over = 1;
+    return rl_completion_matches(text, lrepl_complete_next);
+}
+
+//This function tells if command line option is followed by its argument.
+static int lopt_has_arg(const char* opt) {
+    return strcmp(opt, "-e") == 0 || strcmp(opt, "--batch") == 0 || strcmp(opt, "--serve") == 0
+        || strcmp(opt, "--workers") == 0;
+}
+
+//This function reads one command line file, it runs as a pool task.
+static void lpreload_run(void* arg) {
+    lpreload_t* p = arg;
+    p->forms = lval_read_file(p->interp, p->path, 1);
+    ljob_finish(p->job);
+}
+
+/**
+ * @brief
+ * This function reads and parses all files given on the command line concurrently on the thread pool
+ * for --parallel-parse. Returns array with an entry per argument, evaluation is left to the caller.
+ * A file named twice is read once, later mentions load it again when their turn comes.
+*/
+static lpreload_t* lpreload_files(linterp_t* it, int argc, char** argv) {
+    lpreload_t* p = calloc(argc, sizeof(lpreload_t));
+    int* todo = malloc(sizeof(int) * argc);
+    int n = 0;
+    for (int i = 1; i < argc; i++) {
+        if (lopt_has_arg(argv[i])) { i++; continue; }
+        if (argv[i][0] == '-' && argv[i][1] != '\0') { continue; }
+        if (strcmp(argv[i], "-") == 0) { continue; }
+        int seen = 0;
+        for (int k = 0; k < n && !seen; k++) { seen = strcmp(argv[todo[k]], argv[i]) == 0; }
+        if (!seen) { todo[n++] = i; }
+    }
 
-    lenv_t* e = lenv_new();
-    lenv_add_builtins(e);
+    ljob_t job;
+    ljob_init(&job, n);
+    lpool_t* pool = lpool_get();
+    for (int k = 0; k < n; k++) {
+        lpreload_t* f = &p[todo[k]];
+        f->interp = it;
+        f->path = argv[todo[k]];
+        f->job = &job;
+        if (pool->nworkers == 0) { lpreload_run(f); } else { lpool_submit((ltask_t){lpreload_run, f}); }
+    }
+    ljob_wait(&job);
+    ljob_destroy(&job);
+    free(todo);
+    return p;
+}
+
+int main(int argc, char** argv) {
 
-    if (argc == 1) {
+    linterp_t* it = linterp_new();
+    lenv_t* e = it->env;
+    int status = 0;
+    int workers = 1;
+
+    if (argc == 1 && !isatty(STDIN_FILENO)) {
+        //Input is piped or redirected, so there is no one to prompt. 
+        lval_run_stream(e, STDIN_FILENO, "<stdin>");
+    } else if (argc == 1) {
 
         //Printing version and exit information. 
-        puts("TinyLisp Version 0.0.0.1.0");
-        puts("Press Ctrl+C to Exit\n");
+        lout_puts(it, "TinyLisp Version 0.0.0.1.0\n");
+        lout_puts(it, "Press Ctrl+C to Exit\n\n");
+
+        /* Tab completes symbols bound in the global environment */
+        lrepl_env = e;
+        rl_attempted_completion_function = lrepl_complete;
+        rl_basic_word_break_characters = " \t\n\"(){};";
         
+        /* Lines are collected until brackets and strings are closed, the scanner sees every line once */
+        lbuf_t pending;
+        lbuf_init(&pending);
+        lscan_t scan;
+        lscan_init(&scan);
+
         while (1) {
         
-            char* input = readline("tinylisp> "); //Outputing prompt and getting input. 
-            
-            add_history(input); //Adding input to history. 
-            
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, TinyLisp, &r)) { //Attempting to parse the user input. 
-                //If succsessful, print the AST
-                lval_t* result = lval_eval(e, lval_read(r.output));
-                lval_println(result);
-                lval_del(result);
-                //mpc_ast_print(r.output);
-                mpc_ast_delete(r.output);
-            } else {
-                //Otherwise printing the error and deleting result. 
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
-            } 
-
+            lout_flush(it); //Everything printed must be visible before the prompt. 
+            char* input = readline(pending.len ? "      ...> " : "tinylisp> "); //Outputing prompt and getting input. 
+            if (!input) { lout_putc(it, '\n'); break; } //End of input (Ctrl+D). 
+
+            size_t n = strlen(input);
+            lscan_feed(&scan, input, n);
+            lscan_feed(&scan, "\n", 1);
+            lbuf_append(&pending, input, n);
             free(input); //Free retrieved input. 
+            if (scan.depth > 0 || scan.in_str) {
+                lbuf_putc(&pending, '\n');
+                continue;
+            }
+
+            lbuf_putc(&pending, '\0');
+            add_history(pending.data); //Adding whole input to history. 
+
+            //Parsing all lines together, then evaluating and printing result or error. 
+            uint32_t file = lsrc_register_text("<stdin>", pending.data, pending.len - 1);
+            lval_eval_line(e, "<stdin>", pending.data, file, 0);
+
+            pending.len = 0;
+            lscan_init(&scan);
         }
+        lbuf_free(&pending);
     } else if (argc >= 2) {
-        /* loop over each supplied filename (starting from 1) */
+        /* --parallel-parse reads all files up front, they are still evaluated in command line order */
+        lpreload_t* preload = NULL;
+        for (int i = 1; i < argc && !preload; i++) {
+            if (lopt_has_arg(argv[i])) { i++; continue; }
+            if (strcmp(argv[i], "--parallel-parse") == 0) { preload = lpreload_files(it, argc, argv); }
+        }
+
+        /* loop over each supplied argument (starting from 1), options are handled in order with files */
         for (int i = 1; i < argc; i++) {
+
+        if (lopt_has_arg(argv[i]) && i + 1 == argc) {
+            lout_printf(it, "Error: option %s needs an argument\n", argv[i]);
+            status = 1;
+            break;
+        }
+
+        /* -e EXPR evaluates expression and prints its result */
+        if (strcmp(argv[i], "-e") == 0) {
+            i++;
+            lval_eval_line(e, "<expr>", argv[i], lsrc_register_text("<expr>", argv[i], strlen(argv[i])), 0);
+            continue;
+        }
+
+        /* --workers N makes the following --batch and --serve fork N processes sharing what was loaded */
+        if (strcmp(argv[i], "--workers") == 0) {
+            char* end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n < 1 || n > LFORK_MAX_WORKERS) {
+                lout_printf(it, "Error: option --workers needs a number from 1 to %d\n", LFORK_MAX_WORKERS);
+                status = 1;
+                break;
+            }
+            workers = (int)n;
+            continue;
+        }
+
+        /* --batch FILE evaluates every line of file as separate expression */
+        if (strcmp(argv[i], "--batch") == 0) {
+            if (!lval_run_batch(e, argv[++i], workers)) { status = 1; }
+            continue;
+        }
+
+        /* --serve PATH answers requests on Unix socket, files loaded before it make the shared environment */
+        if (strcmp(argv[i], "--serve") == 0) {
+            if (!lval_serve(e, argv[++i], workers)) { status = 1; }
+            continue;
+        }
+
+        /* "-" stands for program read from stdin */
+        if (strcmp(argv[i], "-") == 0) {
+            lval_run_stream(e, STDIN_FILENO, "<stdin>");
+            continue;
+        }
+
+        if (strcmp(argv[i], "--parallel-parse") == 0) { continue; }
+
+        /* File read up front is only evaluated */
+        if (preload && preload[i].forms) {
+            lval_t* forms = preload[i].forms;
+            preload[i].forms = NULL;
+            if (forms->type == LVAL_ERR) { lval_println(it, forms); lval_del(forms); }
+            else { lval_eval_forms(e, forms); }
+            continue;
+        }
         
         /* Argument list with a single argument, the filename */
         lval_t* args = lval_add(lval_sexpr(), lval_str(argv[i]));
@@ -254,25 +994,34 @@ int main(int argc, char** argv) {
         lval_t* x = builtin_load(e, args);
         
         /* If the result is an error be sure to print it */
-        if (x->type == LVAL_ERR) { lval_println(x); }
+        if (x->type == LVAL_ERR) { lval_println(it, x); }
         lval_del(x);
         }
+        for (int i = 0; preload && i < argc; i++) {
+            if (preload[i].forms) { lval_del(preload[i].forms); }
+        }
+        free(preload);
     }
 
-    mpc_cleanup(9, Number, Float, String, Symbol, Comment, Sexpr, Qexpr, Expr, TinyLisp); //Undefining and deleting parsers   
-    lenv_del(e);
+    linterp_del(it);
   
-    return 0;
+    return status;
 }
 
+#endif
+
 lval_t* lval_eval_sexpr(lenv_t* e, lval_t* v) {
 
+    /* Errors raised by this expression are attributed to its position */
+    uint32_t file = v->src_file, pos = v->src_pos;
+
+    v = lval_thaw(v);
     for (int i = 0; i < v->count; i++) {
         v->cell[i] = lval_eval(e, v->cell[i]);
     }
 
     for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+        if (v->cell[i]->type == LVAL_ERR) { return lval_locate(lval_take(v, i), file, pos); }
     }
 
     if (v->count == 0) { return v; }
@@ -286,12 +1035,12 @@ lval_t* lval_eval_sexpr(lenv_t* e, lval_t* v) {
             "Got %s, Expected %s.",
             ltype_name(f->type), ltype_name(LVAL_FUN));
         lval_del(f); lval_del(v);
-        return err;
+        return lval_locate(err, file, pos);
     }
 
     lval_t* result = lval_call(e, f, v);
     lval_del(f);
-    return result;
+    return lval_locate(result, file, pos);
 }
 
 /**
@@ -301,7 +1050,7 @@ lval_t* lval_eval_sexpr(lenv_t* e, lval_t* v) {
 
 lval_t* lval_eval(lenv_t* e, lval_t* v) {
     if (v->type == LVAL_SYM) {
-        lval_t* x = lenv_get(e, v);
+        lval_t* x = lval_locate(lenv_get(e, v), v->src_file, v->src_pos);
         lval_del(v);
         return x;
     }
@@ -326,8 +1075,8 @@ lval_t* builtin_op(lenv_t* e, lval_t* a, char* op) {
         }
     }
 
-    //Popping the first element. 
-    lval_t* x = lval_pop(a, 0);
+    //Popping the first element, the result is computed in it. 
+    lval_t* x = lval_thaw(lval_pop(a, 0));
 
     //If no arguments and sub then perform unary negation. 
     if ((strcmp(op, "-") == 0) && a->count == 0) {
@@ -339,6 +1088,8 @@ lval_t* builtin_op(lenv_t* e, lval_t* a, char* op) {
             case LVAL_FLOAT: 
                 x->dnum = -x->dnum; 
                 break;
+            default:
+                break;
         }
     }
 
@@ -397,36 +1148,125 @@ long ipow(long base, int exp) {
     return res;
 }
 
-/**
- * @brief
- * This function prints result of expression depending on type of result - double or long.
-*/
-void lval_print(lval_t* res) {
+//This function prints value that has no elements: everything except lists and lambdas.
+static void lval_print_atom(linterp_t* it, lval_t* res) {
   switch (res->type) {
-    case LVAL_NUM:   printf("%ld", res->num); break;
-    case LVAL_FLOAT: printf("%f", res->dnum); break;
-    case LVAL_ERR:   printf("Error: %s", res->err); break;
-    case LVAL_SYM:   printf("%s", res->sym); break;
-    case LVAL_SEXPR: lval_expr_print(res, '(', ')'); break;
-    case LVAL_QEXPR: lval_expr_print(res, '{', '}'); break;
-    case LVAL_STR:   lval_print_str(res); break;
-    case LVAL_FUN:
-        if (res->builtin) {
-            printf("<builtin>");
+    case LVAL_NUM:   lout_printf(it, "%ld", res->num); break;
+    case LVAL_FLOAT: lout_printf(it, "%f", res->dnum); break;
+    case LVAL_ERR: {
+        char* name;
+        long line, col;
+        if (lsrc_locate(res->src_file, res->src_pos, &name, &line, &col)) {
+            lout_printf(it, "Error: %s:%ld:%ld: ", name, line, col);
         } else {
-            printf("(\\ "); lval_print(res->formals);
-            putchar(' '); lval_print(res->body); putchar(')');
+            lout_puts(it, "Error: ");
         }
+        lout_puts(it, res->err);
         break;
+    }
+    case LVAL_SYM:   lout_puts(it, res->sym); break;
+    case LVAL_STR:   lval_print_str(it, res); break;
+    case LVAL_FILE:  lout_printf(it, "<file %s%s>", res->file->path, __atomic_load_n(&res->file->fd, __ATOMIC_RELAXED) < 0 ? " closed" : ""); break;
+    case LVAL_FUTURE: lout_puts(it, __atomic_load_n(&res->future->job.remaining, __ATOMIC_ACQUIRE) ? "<future>" : "<future done>"); break;
+    case LVAL_ISOLATE: lout_puts(it, "<isolate>"); break;
+    case LVAL_TASK: lout_puts(it, res->task->state == LCORO_DONE ? "<task done>" : "<task>"); break;
+    case LVAL_GEN: lout_puts(it, res->gen->state == LCORO_DONE ? "<generator done>" : "<generator>"); break;
+    case LVAL_FUN:   lout_puts(it, "<builtin>"); break;
+    default: break; //Lists are printed by lval_print.
   }
 }
 
+/**
+ * @brief
+ * This function prints value without recursion, so any nesting depth can be printed.
+ * Lists (and lambdas, as (\ formals body)) being printed are kept on an explicit stack.
+ * With limits, lists nested deeper than o->depth are shown as (...) and only the first o->length
+ * elements of a list are shown, followed by "...". Negative limit (or no options) means no limit.
+*/
+void lval_print_opts(linterp_t* it, lval_t* res, lprint_opts_t* o) {
+    long max_len = o ? o->length : -1;
+    long max_depth = o ? o->depth : -1;
+
+    lprint_frame_t local[64];
+    lprint_frame_t* stack = local;
+    int cap = 64, top = 0;
+
+    lval_t* v = res;
+    while (1) {
+        /* Open the value: print atoms, push lists */
+        if (v) {
+            int lambda = v->type == LVAL_FUN && !v->builtin;
+            if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR && !lambda) {
+                lval_print_atom(it, v);
+            } else if (max_depth >= 0 && top >= max_depth) {
+                lout_puts(it, v->type == LVAL_QEXPR ? "{...}" : "(...)");
+            } else {
+                if (top == cap) {
+                    cap *= 2;
+                    if (stack == local) {
+                        stack = malloc(sizeof(lprint_frame_t) * cap);
+                        memcpy(stack, local, sizeof(local));
+                    } else {
+                        stack = realloc(stack, sizeof(lprint_frame_t) * cap);
+                    }
+                }
+                stack[top].v = v;
+                stack[top].i = 0;
+                top++;
+                lout_puts(it, lambda ? "(\\ " : (v->type == LVAL_QEXPR ? "{" : "("));
+            }
+        }
+        if (top == 0) { break; }
+
+        /* Continue innermost list being printed with its next element */
+        lprint_frame_t* f = &stack[top-1];
+        if (f->v->type == LVAL_FUN) {
+            if (f->i < 2) {
+                if (f->i == 1) { lout_putc(it, ' '); }
+                v = f->i++ ? f->v->body : f->v->formals;
+                continue;
+            }
+        } else if (f->i < f->v->count) {
+            if (f->i > 0) { lout_putc(it, ' '); }
+            if (max_len < 0 || f->i < max_len) {
+                v = f->v->cell[f->i++];
+                continue;
+            }
+            lout_puts(it, "...");
+        }
+
+        lout_putc(it, f->v->type == LVAL_QEXPR ? '}' : ')');
+        top--;
+        v = NULL;
+        if (top == 0) { break; }
+    }
+
+    if (stack != local) { free(stack); }
+}
+
+//This function prints value without limits.
+void lval_print(linterp_t* it, lval_t* res) {
+    lval_print_opts(it, res, NULL);
+}
+
+//This function reads *print-length* and *print-depth* from environment. Unbound or non-number means no limit.
+void lprint_opts_get(lenv_t* e, lprint_opts_t* o) {
+    o->length = lenv_get_num(e, "*print-length*", -1);
+    o->depth = lenv_get_num(e, "*print-depth*", -1);
+}
+
 //This function prints an lval followed by a newline
-void lval_println(lval_t* res) { lval_print(res); putchar('\n'); }
+void lval_println(linterp_t* it, lval_t* res) { lval_print(it, res); lout_putc(it, '\n'); }
+
+//This function prints an lval with limits followed by a newline
+void lval_println_opts(linterp_t* it, lval_t* res, lprint_opts_t* o) { lval_print_opts(it, res, o); lout_putc(it, '\n'); }
 
 //This function frees memory of given operand
 void lval_del(lval_t* v) {
 
+    /* Frozen value is deleted by its last holder */
+    if (lval_frozen(v) && __atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+
     switch (v->type) {
         //Doing nothing for number or float types. 
         case LVAL_NUM: break;
@@ -435,7 +1275,14 @@ void lval_del(lval_t* v) {
         //For Err or Sym freeing the string data.
         case LVAL_ERR: free(v->err); break;
         case LVAL_SYM: free(v->sym); break;
-        case LVAL_STR: free(v->str); break;
+        case LVAL_STR:
+            if (v->owner) { lstrbuf_release(v->owner); } else { free(v->str); }
+            break;
+        case LVAL_FILE: lfile_release(v->file); break;
+        case LVAL_FUTURE: lfuture_release(v->future); break;
+        case LVAL_ISOLATE: lmailbox_release(v->mailbox); break;
+        case LVAL_TASK: lcoro_release(v->task); break;
+        case LVAL_GEN: lcoro_release(v->gen); break;
 
         case LVAL_FUN:
             if (!v->builtin) {
@@ -460,9 +1307,18 @@ void lval_del(lval_t* v) {
     free(v);
 }
 
+//This function allocates value structure with no source position. All constructors go through it.
+lval_t* lval_alloc(void) {
+    lval_t* v = malloc(sizeof(lval_t));
+    v->src_pos = 0;
+    v->src_file = 0;
+    v->refs = 0;
+    return v;
+}
+
 //This function creates structure of long type of number.
 lval_t* lval_num(long x) {
-    lval_t* v = (lval_t *)malloc(sizeof(lval_t));
+    lval_t* v = lval_alloc();
     v->type = LVAL_NUM;
     v->num = x;
     return v;
@@ -470,7 +1326,7 @@ lval_t* lval_num(long x) {
 
 //This function creates structure of double type of number. 
 lval_t* lval_float(double x) {
-    lval_t* v = (lval_t *)malloc(sizeof(lval_t));
+    lval_t* v = lval_alloc();
     v->type = LVAL_FLOAT;
     v->dnum = x;
     return v;
@@ -478,7 +1334,7 @@ lval_t* lval_float(double x) {
 
 //This function creates structure based on input error. 
 lval_t* lval_err(char* fmt, ...) {
-    lval_t* v = malloc(sizeof(lval_t));
+    lval_t* v = lval_alloc();
     v->type = LVAL_ERR;
 
     /* Create a va list and initialize it */
@@ -502,7 +1358,7 @@ lval_t* lval_err(char* fmt, ...) {
 
 //This function creates structure of parsed symbol. 
 lval_t* lval_sym(char* s) {
-  lval_t* v = malloc(sizeof(lval_t));
+  lval_t* v = lval_alloc();
   v->type = LVAL_SYM;
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
@@ -511,7 +1367,7 @@ lval_t* lval_sym(char* s) {
 
 //This function creates structure of S-expression. 
 lval_t* lval_sexpr(void) {
-  lval_t* v = malloc(sizeof(lval_t));
+  lval_t* v = lval_alloc();
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
@@ -520,7 +1376,7 @@ lval_t* lval_sexpr(void) {
 
 //This function creates structure of S-expression. 
 lval_t* lval_qexpr(void) {
-  lval_t* v = malloc(sizeof(lval_t));
+  lval_t* v = lval_alloc();
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
@@ -528,86 +1384,305 @@ lval_t* lval_qexpr(void) {
 }
 
 lval_t* lval_fun(lbuiltin func) {
-  lval_t* v = malloc(sizeof(lval_t));
+  lval_t* v = lval_alloc();
   v->type = LVAL_FUN;
   v->builtin = func;
   return v;
 }
 
 lval_t* lval_str(char* s) {
-    lval_t* v = malloc(sizeof(lval_t));
+    lval_t* v = lval_alloc();
     v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
+    v->len = strlen(s);
+    v->owner = NULL;
+    v->str = malloc(v->len + 1);
+    memcpy(v->str, s, v->len + 1);
     return v;
 }
 
-//This function parses number from AST. 
-lval_t* lval_read_num(mpc_ast_t* t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ?
-    lval_num(x) : lval_err("invalid number");
+//This function creates string structure taking ownership of malloc'ed s instead of copying it.
+lval_t* lval_str_own(char* s) {
+    lval_t* v = lval_alloc();
+    v->type = LVAL_STR;
+    v->str = s;
+    v->owner = NULL;
+    v->len = strlen(s);
+    return v;
 }
 
-//This function parses float number from AST. 
-lval_t* lval_read_float(mpc_ast_t* t) {
-  errno = 0;
-  double x = strtof(t->contents, NULL);
-  return errno != ERANGE ?
+//This function creates owned string from n bytes.
+lval_t* lval_str_len(const char* s, size_t n) {
+    char* str = malloc(n + 1);
+    memcpy(str, s, n);
+    str[n] = '\0';
+    lval_t* v = lval_str_own(str);
+    v->len = n;
+    return v;
+}
+
+//This function creates string referring to n bytes inside shared buffer, taking one more reference to it.
+lval_t* lval_slice(lstrbuf_t* owner, char* s, size_t n) {
+    lval_t* v = lval_alloc();
+    v->type = LVAL_STR;
+    v->str = s;
+    v->len = n;
+    v->owner = owner;
+    __atomic_add_fetch(&owner->refs, 1, __ATOMIC_RELAXED);
+    return v;
+}
+
+//This function turns slice into owned NUL-terminated string in place and returns it. Needed wherever C string is expected.
+char* lval_str_cstr(lval_t* v) {
+    if (v->owner) {
+        char* s = malloc(v->len + 1);
+        memcpy(s, v->str, v->len);
+        s[v->len] = '\0';
+        lstrbuf_release(v->owner);
+        v->owner = NULL;
+        v->str = s;
+    }
+    return v->str;
+}
+
+/**
+ * @brief
+ * This function materializes slices in value which would keep a big buffer alive for a small part of it
+ * (buffer over LSTR_PIN_MIN and more than LSTR_PIN_RATIO times the slice). Used before values are stored by def.
+*/
+void lval_unpin(lval_t* v) {
+    if (lval_frozen(v)) { return; } //Frozen strings own their bytes.
+    if (v->type == LVAL_STR && v->owner && v->owner->size >= LSTR_PIN_MIN
+        && v->len < v->owner->size / LSTR_PIN_RATIO) {
+        lval_str_cstr(v);
+    }
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        for (int i = 0; i < v->count; i++) { lval_unpin(v->cell[i]); }
+    }
+}
+
+//This function drops one reference to shared string buffer, freeing it with the last one. Counts are atomic, copies may live on other threads.
+void lstrbuf_release(lstrbuf_t* b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    if (b->mapped) { munmap(b->data, b->size); } else { free(b->data); }
+    free(b);
+}
+
+//This function parses number from AST. 
+lval_t* lval_read_num(mpc_ast_t* t) {
+  errno = 0;
+  long x = strtol(t->contents, NULL, 10);
+  return errno != ERANGE ?
+    lval_num(x) : lval_err("invalid number");
+}
+
+//This function parses float number from AST. 
+lval_t* lval_read_float(mpc_ast_t* t) {
+  errno = 0;
+  double x = strtof(t->contents, NULL);
+  return errno != ERANGE ?
     lval_float(x) : lval_err("invalid number");
 }
 
 //This function parses AST into Lisp S-expression.
 lval_t* lval_read(mpc_ast_t* t) {
+    return lval_read_src(t, 0, 0);
+}
 
-    //If Symbol or Number returning conversion to that type. 
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "float")) { return lval_read_float(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-    if (strstr(t->tag, "string")) { return lval_read_str(t); }
+/**
+ * @brief
+ * This function parses AST into Lisp S-expression, recording position of every value.
+ * Base is offset of the parsed text in its file, as parts of a file may be parsed separately.
+*/
+lval_t* lval_read_src(mpc_ast_t* t, uint32_t file, size_t base) {
 
-    //If root (>) or sexpr then creating empty list. 
+    //If Symbol or Number returning conversion to that type. 
     lval_t* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-    if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
-    if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
-
-    //Filling this list with any valid expression contained within. 
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-        if (strstr(t->children[i]->tag, "comment")) { continue; }
-        x = lval_add(x, lval_read(t->children[i]));
+    if (strstr(t->tag, "number")) { x = lval_read_num(t); }
+    else if (strstr(t->tag, "float")) { x = lval_read_float(t); }
+    else if (strstr(t->tag, "symbol")) { x = lval_sym(t->contents); }
+    else if (strstr(t->tag, "string")) { x = lval_read_str(t); }
+
+    if (!x) {
+        //If root (>) or sexpr then creating empty list. 
+        if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+        if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
+        if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+
+        //Filling this list with any valid expression contained within. 
+        for (int i = 0; i < t->children_num; i++) {
+            if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+            if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+            if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+            if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+            if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
+            if (strstr(t->children[i]->tag, "comment")) { continue; }
+            x = lval_add(x, lval_read_src(t->children[i], file, base));
+        }
     }
 
+    if (file) {
+        size_t pos = base + (size_t)t->state.pos;
+        x->src_file = file;
+        x->src_pos = pos > UINT32_MAX ? UINT32_MAX : (uint32_t)pos;
+    }
     return x;
 }
 
-//This function adds element to an array of numbers or expressions. It increases count variable, allocates more memory and adds new element.
-lval_t* lval_add(lval_t* v, lval_t* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval_t*) * v->count);
-    v->cell[v->count-1] = x;
-    return v;
+lsrc_file_t* lsrc_files = NULL;
+uint32_t lsrc_count = 0;
+uint32_t* lsrc_index = NULL; //Open addressing table of file ids by key, 0 is an empty slot.
+uint32_t lsrc_index_cap = 0;
+lsrc_file_t lsrc_texts[LSRC_TEXTS];
+uint32_t lsrc_text_count = 0;
+pthread_mutex_t lsrc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//This function puts id of registered file into the first free slot of lsrc_index.
+static void lsrc_index_put(uint32_t id) {
+    size_t j = lsrc_files[id-1].key & (lsrc_index_cap - 1);
+    while (lsrc_index[j]) { j = (j + 1) & (lsrc_index_cap - 1); }
+    lsrc_index[j] = id;
 }
 
-void lval_expr_print(lval_t* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
+//This function indexes newly registered file, rebuilding the index twice as big when it gets half full. Called with lsrc_lock held.
+static void lsrc_index_add(uint32_t id) {
+    if (lsrc_count * 2 > lsrc_index_cap) {
+        free(lsrc_index);
+        lsrc_index_cap = lsrc_index_cap ? lsrc_index_cap * 2 : 64;
+        lsrc_index = calloc(lsrc_index_cap, sizeof(uint32_t));
+        for (uint32_t i = 1; i < id; i++) {
+            if (lsrc_files[i-1].key) { lsrc_index_put(i); }
+        }
+    }
+    lsrc_index_put(id);
+}
+
+/**
+ * @brief
+ * This function registers source file whose values are about to be read and returns its id (never 0).
+ * Every distinct text gets its own id, so values read earlier keep their positions, and it is kept for good.
+ * Loading unchanged file again reuses its id. Texts which come and go use lsrc_register_text instead.
+*/
+uint32_t lsrc_register(const char* name, const char* contents, size_t size) {
+    uint64_t key = (lhash_bytes(name, strlen(name)) * 1099511628211ULL ^ lhash_bytes(contents, size)) | 1;
+    pthread_mutex_lock(&lsrc_lock);
+
+    /* Same name and text means the old line table is still right */
+    for (size_t j = key & (lsrc_index_cap - 1); lsrc_index_cap && lsrc_index[j]; j = (j + 1) & (lsrc_index_cap - 1)) {
+        lsrc_file_t* f = &lsrc_files[lsrc_index[j]-1];
+        if (f->key == key && f->size == size && strcmp(f->name, name) == 0) {
+            uint32_t id = lsrc_index[j];
+            pthread_mutex_unlock(&lsrc_lock);
+            return id;
+        }
+    }
+
+    uint32_t id = ++lsrc_count;
+    lsrc_files = realloc(lsrc_files, sizeof(lsrc_file_t) * lsrc_count);
+    lsrc_file_t* f = &lsrc_files[id-1];
+    f->name = malloc(strlen(name) + 1);
+    strcpy(f->name, name);
+    f->key = key;
+    f->size = size;
+    f->id = id;
+
+    /* Remember offset of every line start */
+    f->cap = 8;
+    f->lines = malloc(sizeof(uint32_t) * f->cap);
+    f->lines[0] = 0;
+    f->nlines = 1;
+    lsrc_add_lines(f, contents, size, 0);
+    lsrc_index_add(id);
+
+    pthread_mutex_unlock(&lsrc_lock);
+    return id;
+}
 
-        //Print Value contained within. 
-        lval_print(v->cell[i]);
+/**
+ * @brief
+ * This function registers short-lived source text (REPL entry, -e, request of the server, lisp_eval) in the
+ * next slot of a ring, so a long-running process keeps positions only for the last LSRC_TEXTS of them. Values
+ * read from a text whose slot was taken over since lose their position instead of showing a wrong one.
+ * Name must be a string constant, lsrc_locate hands it out after the slot may be reused.
+*/
+uint32_t lsrc_register_text(const char* name, const char* contents, size_t size) {
+    pthread_mutex_lock(&lsrc_lock);
+    if (++lsrc_text_count == LSRC_TEXT_ID) { lsrc_text_count = 1; }
+    uint32_t id = LSRC_TEXT_ID | lsrc_text_count;
+    lsrc_file_t* f = &lsrc_texts[lsrc_text_count % LSRC_TEXTS];
+    if (!f->lines) {
+        f->cap = 8;
+        f->lines = malloc(sizeof(uint32_t) * f->cap);
+    }
+    f->name = (char*)name;
+    f->key = 0;
+    f->size = size;
+    f->id = id;
+    f->lines[0] = 0;
+    f->nlines = 1;
+    lsrc_add_lines(f, contents, size, 0);
+    pthread_mutex_unlock(&lsrc_lock);
+    return id;
+}
 
-        //Don't print trailing space if last element. 
-        if (i != (v->count-1)) {
-        putchar(' ');
+//This function records line starts found in n bytes of source placed at offset base of the file.
+static void lsrc_add_lines(lsrc_file_t* f, const char* text, size_t n, size_t base) {
+    if (base >= UINT32_MAX) { return; }
+    const char* end = text + (base + n > UINT32_MAX ? UINT32_MAX - base : n);
+    for (const char* c = text; (c = memchr(c, '\n', end - c)); c++) {
+        if (f->nlines == f->cap) {
+            f->cap *= 2;
+            f->lines = realloc(f->lines, sizeof(uint32_t) * f->cap);
         }
+        f->lines[f->nlines++] = (uint32_t)(base + (c + 1 - text));
     }
-    putchar(close);
+}
+
+//This function extends line table of registered file read piece by piece (like stdin) with the next n bytes at offset base.
+void lsrc_append(uint32_t file, const char* text, size_t n, size_t base) {
+    pthread_mutex_lock(&lsrc_lock);
+    lsrc_files[file-1].key = 0;
+    lsrc_add_lines(&lsrc_files[file-1], text, n, base);
+    pthread_mutex_unlock(&lsrc_lock);
+}
+
+//This function turns file id and offset into file name, line and column (both from 1). Returns 0 for values without position.
+int lsrc_locate(uint32_t file, uint32_t pos, char** name, long* line, long* col) {
+    if (file == 0) { return 0; }
+    pthread_mutex_lock(&lsrc_lock);
+
+    lsrc_file_t* f = file & LSRC_TEXT_ID ? &lsrc_texts[(file & ~LSRC_TEXT_ID) % LSRC_TEXTS] : &lsrc_files[file-1];
+    if (f->id != file) { //Ring slot was taken by a newer text.
+        pthread_mutex_unlock(&lsrc_lock);
+        return 0;
+    }
+    uint32_t lo = 0, hi = f->nlines;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (f->lines[mid] <= pos) { lo = mid; } else { hi = mid; }
+    }
+    *name = f->name;
+    *line = lo + 1;
+    *col = pos - f->lines[lo] + 1;
+
+    pthread_mutex_unlock(&lsrc_lock);
+    return 1;
+}
+
+//This function attributes error to given source position, unless it already has one.
+lval_t* lval_locate(lval_t* v, uint32_t file, uint32_t pos) {
+    if (v->type == LVAL_ERR && v->src_file == 0 && file && !lval_frozen(v)) {
+        v->src_file = file;
+        v->src_pos = pos;
+    }
+    return v;
+}
+
+//This function adds element to an array of numbers or expressions. It increases count variable, allocates more memory and adds new element.
+lval_t* lval_add(lval_t* v, lval_t* x) {
+    v->count++;
+    v->cell = realloc(v->cell, sizeof(lval_t*) * v->count);
+    v->cell[v->count-1] = x;
+    return v;
 }
 
 //This function pops elements from S-expression array and shifts all elements backwards.
@@ -643,7 +1718,7 @@ lval_t* builtin_head(lenv_t* e, lval_t* a) {
     LASSERT(a, a->cell[0]->count != 0,
         "Function 'head' passed {}!");
 
-    lval_t* v = lval_take(a, 0);
+    lval_t* v = lval_thaw(lval_take(a, 0));
     while (v->count > 1) { lval_del(lval_pop(v, 1)); }
     return v;
 }
@@ -657,7 +1732,7 @@ lval_t* builtin_tail(lenv_t* e, lval_t* a) {
     LASSERT(a, a->cell[0]->count != 0,
         "Function 'tail' passed {}!");
 
-    lval_t* v = lval_take(a, 0);
+    lval_t* v = lval_thaw(lval_take(a, 0));
     lval_del(lval_pop(v, 0));
     return v;
 }
@@ -675,7 +1750,7 @@ lval_t* builtin_eval(lenv_t* e, lval_t* a) {
     LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
         "Function 'eval' passed incorrect type!");
 
-    lval_t* x = lval_take(a, 0);
+    lval_t* x = lval_thaw(lval_take(a, 0));
     x->type = LVAL_SEXPR;
     return lval_eval(e, x);
 }
@@ -688,10 +1763,10 @@ lval_t* builtin_join(lenv_t* e, lval_t* a) {
       "Function 'join' passed incorrect type.");
   }
 
-  lval_t* x = lval_pop(a, 0);
+  lval_t* x = lval_thaw(lval_pop(a, 0));
 
   while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
+    x = lval_join(x, lval_thaw(lval_pop(a, 0)));
   }
 
   lval_del(a);
@@ -720,8 +1795,8 @@ lval_t* builtin_init(lenv_t* e, lval_t* a) {
     LASSERT(a, a->cell[0]->count != 0,
         "Function 'init' passed {}!");
 
-    lval_t* v = lval_take(a, 0);
-    lval_del(lval_pop(v, a->count-1));
+    lval_t* v = lval_thaw(lval_take(a, 0));
+    lval_del(lval_pop(v, v->count-1));
     return v;
 }
 
@@ -734,7 +1809,8 @@ lval_t* builtin_len(lenv_t* e, lval_t* a) {
     LASSERT(a, a->cell[0]->count != 0,
         "Function 'len' passed {}!");
 
-    lval_t* v = lval_num(lval_take(a, 0)->count);
+    lval_t* v = lval_num(a->cell[0]->count);
+    lval_del(a);
     return v;
 }
 
@@ -748,7 +1824,7 @@ lval_t* builtin_cons(lenv_t* e, lval_t* a) {
 
     lval_t* val = lval_pop(a, 0);
     
-    lval_t* qexpr = lval_take(a, 0);
+    lval_t* qexpr = lval_thaw(lval_take(a, 0));
 
     qexpr->count++;
     
@@ -760,9 +1836,21 @@ lval_t* builtin_cons(lenv_t* e, lval_t* a) {
 }
 
 lval_t* lval_copy(lval_t* v) {
+    /* Frozen values are shared instead of copied */
+    if (lval_frozen(v)) {
+        __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+        return v;
+    }
+    return lval_dup(v);
+}
 
-  lval_t* x = malloc(sizeof(lval_t));
+//This function copies value itself, elements of lists and parts of lambdas are copied by lval_copy.
+static lval_t* lval_dup(lval_t* v) {
+
+  lval_t* x = lval_alloc();
   x->type = v->type;
+  x->src_pos = v->src_pos;
+  x->src_file = v->src_file;
 
   switch (v->type) {
 
@@ -778,10 +1866,45 @@ lval_t* lval_copy(lval_t* v) {
         }
         break;
     case LVAL_NUM: x->num = v->num; break;
+    case LVAL_FLOAT: x->dnum = v->dnum; break;
+
+    case LVAL_FILE:
+        x->file = v->file;
+        __atomic_add_fetch(&x->file->refs, 1, __ATOMIC_RELAXED);
+        break;
+
+    case LVAL_FUTURE:
+        x->future = v->future;
+        __atomic_add_fetch(&x->future->refs, 1, __ATOMIC_RELAXED);
+        break;
+
+    case LVAL_ISOLATE:
+        x->mailbox = v->mailbox;
+        __atomic_add_fetch(&x->mailbox->refs, 1, __ATOMIC_RELAXED);
+        break;
+
+    case LVAL_TASK:
+        x->task = v->task;
+        __atomic_add_fetch(&x->task->refs, 1, __ATOMIC_RELAXED);
+        break;
+
+    case LVAL_GEN:
+        x->gen = v->gen;
+        __atomic_add_fetch(&x->gen->refs, 1, __ATOMIC_RELAXED);
+        break;
 
+    /* Slices share their buffer, owned strings are copied */
     case LVAL_STR: 
-        x->str = malloc(strlen(v->str) + 1);
-        strcpy(x->str, v->str); break;
+        x->len = v->len;
+        x->owner = v->owner;
+        if (v->owner) {
+            __atomic_add_fetch(&v->owner->refs, 1, __ATOMIC_RELAXED);
+            x->str = v->str;
+        } else {
+            x->str = malloc(v->len + 1);
+            memcpy(x->str, v->str, v->len + 1);
+        }
+        break;
 
     /* Copy Strings using malloc and strcpy */
     case LVAL_ERR:
@@ -806,12 +1929,135 @@ lval_t* lval_copy(lval_t* v) {
   return x;
 }
 
+//This function tells if value is frozen. Frozenness doesn't change while value is shared, but holders on other threads count.
+static inline int lval_frozen(lval_t* v) {
+    return __atomic_load_n(&v->refs, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * @brief
+ * This function returns value that may be changed in place: v itself unless it's frozen and shared, otherwise
+ * a copy of it whose elements stay shared (taking over the reference to v). Everything that changes values
+ * it didn't make calls it first.
+*/
+lval_t* lval_thaw(lval_t* v) {
+    if (!lval_frozen(v)) { return v; }
+    if (__atomic_load_n(&v->refs, __ATOMIC_ACQUIRE) == 1) {
+        v->refs = 0; //The only holder may take it over.
+        return v;
+    }
+    lval_t* x = lval_dup(v);
+    lval_del(v);
+    return x;
+}
+
+/**
+ * @brief
+ * This function makes value and everything in it immutable. Copies of frozen values are the same value
+ * with one more reference (counted atomically), so they are shared by environments, pmap, futures and isolates
+ * without copying and read by any thread without locks. Slices are copied out of their buffers first,
+ * so frozen strings own their bytes and a big buffer isn't kept for them.
+*/
+void lval_freeze(lval_t* v) {
+    if (lval_frozen(v)) { return; } //Already frozen, the reference to it was counted when it was copied here.
+    switch (v->type) {
+        case LVAL_STR: lval_str_cstr(v); break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) { lval_freeze(v->cell[i]); }
+            break;
+        case LVAL_FUN:
+            if (!v->builtin) {
+                for (int i = 0; i < v->env->count; i++) { lval_freeze(v->env->vals[i]); }
+                lval_freeze(v->formals);
+                lval_freeze(v->body);
+            }
+            break;
+        default: break;
+    }
+    v->refs = 1;
+}
+
+/**
+ * @brief
+ * This function creates interpreter: builds its grammar and global environment with all builtins.
+ * Output goes to stdout.
+*/
+linterp_t* linterp_new(void) {
+    linterp_t* it = malloc(sizeof(linterp_t));
+
+    //Telling parser what it can parse. 
+    it->Number   = mpc_new("number");
+    it->Float    = mpc_new("float");
+    it->String   = mpc_new("string");
+    it->Symbol   = mpc_new("symbol");
+    it->Comment  = mpc_new("comment");
+    it->Sexpr    = mpc_new("sexpr");
+    it->Qexpr    = mpc_new("qexpr");
+    it->Expr     = mpc_new("expr");
+    it->TinyLisp = mpc_new("tinylisp");
+
+    //Defining Lisp grammar. 
+    mpca_lang(MPCA_LANG_DEFAULT,
+    "                                                                     \
+        number   : /-?[0-9]+/ ;                                            \
+        float    : /-?[0-9]+[.][0-9]+/ ;                                    \
+        string   : /\"(\\\\.|[^\"])*\"/ ;                                     \
+        symbol   : /[a-zA-Z0-9_+\\-*\\/\\^\\*\\\\\\=<>!&]+/ ;                    \
+        comment  : /;[^\\r\\n]*/ ;                                               \
+        sexpr    : '(' <expr>* ')' ;                                          \
+        qexpr    : '{' <expr>* '}' ;                                             \
+        expr     : <float> | <number> | <string> | <symbol> | <sexpr> | <qexpr> | <comment> ;          \
+        tinylisp : /^/ <expr>* /$/ ;                                             \
+    ",
+    it->Number, it->Float, it->String, it->Symbol, it->Comment, it->Sexpr, it->Qexpr, it->Expr, it->TinyLisp);
+
+    it->env = lenv_new();
+    it->env->interp = it;
+    it->env->trie = ltrie_new();
+    it->env->lock = malloc(sizeof(pthread_rwlock_t));
+    pthread_rwlock_init(it->env->lock, NULL);
+    lenv_add_builtins(it->env);
+
+    lbuf_init(&it->out);
+    it->out_file = stdout;
+    it->out_capture = 0;
+    it->mailbox = lmailbox_new();
+    it->futures = malloc(sizeof(ljob_t));
+    ljob_init(it->futures, 0);
+    lenv_put_self(it);
+    return it;
+}
+
+/**
+ * @brief
+ * This function writes out remaining output and deletes interpreter with its environment and grammar.
+ * Futures which were never awaited still use them, so it first waits until they finish.
+*/
+void linterp_del(linterp_t* it) {
+    ljob_wait(it->futures);
+    ljob_destroy(it->futures);
+    free(it->futures);
+
+    lout_flush(it);
+    lbuf_free(&it->out);
+    mpc_cleanup(9, it->Number, it->Float, it->String, it->Symbol, it->Comment,
+        it->Sexpr, it->Qexpr, it->Expr, it->TinyLisp); //Undefining and deleting parsers 
+    lenv_del(it->env);
+    lmailbox_release(it->mailbox);
+    free(it);
+}
+
 lenv_t* lenv_new(void) {
     lenv_t* e = malloc(sizeof(lenv_t));
     e->par = NULL;
     e->count = 0;
     e->syms = NULL;
     e->vals = NULL;
+    e->trie = NULL;
+    e->boundary = 0;
+    e->interp = NULL;
+    e->lock = NULL;
     return e;
 }
 
@@ -822,15 +2068,24 @@ void lenv_del(lenv_t* e) {
     }
     free(e->syms);
     free(e->vals);
+    if (e->trie) { ltrie_free(e->trie); }
+    if (e->lock) {
+        pthread_rwlock_destroy(e->lock);
+        free(e->lock);
+    }
     free(e);
 }
 
 lval_t* lenv_get(lenv_t* e, lval_t* k) {
+    if (e->lock) { pthread_rwlock_rdlock(e->lock); }
     for (int i = 0; i < e->count; i++) {
         if (strcmp(e->syms[i], k->sym) == 0) {
-        return lval_copy(e->vals[i]);
+        lval_t* v = lval_copy(e->vals[i]);
+        if (e->lock) { pthread_rwlock_unlock(e->lock); }
+        return v;
         }
     }
+    if (e->lock) { pthread_rwlock_unlock(e->lock); }
 
     /* If no symbol check in parent otherwise error */
     if (e->par) {
@@ -840,7 +2095,24 @@ lval_t* lenv_get(lenv_t* e, lval_t* k) {
     }
 }
 
+//This function returns number bound to symbol, or dflt if it's unbound or not a number.
+long lenv_get_num(lenv_t* e, char* sym, long dflt) {
+    for (; e; e = e->par) {
+        if (e->lock) { pthread_rwlock_rdlock(e->lock); }
+        for (int i = 0; i < e->count; i++) {
+            if (strcmp(e->syms[i], sym) == 0) {
+                long n = e->vals[i]->type == LVAL_NUM ? e->vals[i]->num : dflt;
+                if (e->lock) { pthread_rwlock_unlock(e->lock); }
+                return n;
+            }
+        }
+        if (e->lock) { pthread_rwlock_unlock(e->lock); }
+    }
+    return dflt;
+}
+
 void lenv_put(lenv_t* e, lval_t* k, lval_t* v) {
+    if (e->lock) { pthread_rwlock_wrlock(e->lock); }
 
     /* Iterate over all items in environment */
     /* This is to see if variable already exists */
@@ -851,6 +2123,7 @@ void lenv_put(lenv_t* e, lval_t* k, lval_t* v) {
         if (strcmp(e->syms[i], k->sym) == 0) {
         lval_del(e->vals[i]);
         e->vals[i] = lval_copy(v);
+        if (e->lock) { pthread_rwlock_unlock(e->lock); }
         return;
         }
     }
@@ -864,6 +2137,82 @@ void lenv_put(lenv_t* e, lval_t* k, lval_t* v) {
     e->vals[e->count-1] = lval_copy(v);
     e->syms[e->count-1] = malloc(strlen(k->sym)+1);
     strcpy(e->syms[e->count-1], k->sym);
+
+    /* Keep completion index up to date */
+    if (e->trie) { ltrie_insert(e->trie, k->sym); }
+    if (e->lock) { pthread_rwlock_unlock(e->lock); }
+}
+
+ltrie_t* ltrie_new(void) {
+    return calloc(1, sizeof(ltrie_t));
+}
+
+void ltrie_free(ltrie_t* t) {
+    while (t) {
+        ltrie_t* next = t->next;
+        ltrie_free(t->kids);
+        free(t);
+        t = next;
+    }
+}
+
+//This function adds symbol to trie. Adding symbol which is already there changes nothing.
+void ltrie_insert(ltrie_t* t, const char* s) {
+    for (; *s; s++) {
+        ltrie_t** link = &t->kids;
+        while (*link && (*link)->c < *s) { link = &(*link)->next; }
+        if (!*link || (*link)->c != *s) {
+            ltrie_t* n = ltrie_new();
+            n->c = *s;
+            n->next = *link;
+            *link = n;
+        }
+        t = *link;
+    }
+    t->end = 1;
+}
+
+//This function appends every symbol under node to array, path holds characters leading to the node.
+static void ltrie_collect(ltrie_t* t, lbuf_t* path, char*** out, int* count, int* cap) {
+    if (t->end) {
+        if (*count == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            *out = realloc(*out, sizeof(char*) * (*cap + 1));
+        }
+        char* s = malloc(path->len + 1);
+        memcpy(s, path->data, path->len);
+        s[path->len] = '\0';
+        (*out)[(*count)++] = s;
+    }
+    for (ltrie_t* k = t->kids; k; k = k->next) {
+        lbuf_putc(path, k->c);
+        ltrie_collect(k, path, out, count, cap);
+        path->len--;
+    }
+}
+
+/**
+ * @brief
+ * This function returns NULL-terminated array of malloc'ed symbols starting with prefix in sorted order
+ * and their number in count, or NULL if there are none. Only the subtree of the prefix is visited.
+*/
+char** ltrie_complete(ltrie_t* t, const char* prefix, int* count) {
+    for (const char* c = prefix; *c && t; c++) {
+        t = t->kids;
+        while (t && t->c != *c) { t = t->next; }
+    }
+    *count = 0;
+    if (!t) { return NULL; }
+
+    char** out = NULL;
+    int cap = 0;
+    lbuf_t path;
+    lbuf_init(&path);
+    lbuf_append(&path, prefix, strlen(prefix));
+    ltrie_collect(t, &path, &out, count, &cap);
+    lbuf_free(&path);
+    if (out) { out[*count] = NULL; }
+    return out;
 }
 
 lval_t* builtin_add(lenv_t* e, lval_t* a) {
@@ -950,10 +2299,55 @@ void lenv_add_builtins(lenv_t* e) {
     lenv_add_builtin(e, "load",  builtin_load);
     lenv_add_builtin(e, "error", builtin_error);
     lenv_add_builtin(e, "print", builtin_print);
+
+    /* Serialization Functions */
+    lenv_add_builtin(e, "serialize", builtin_serialize);
+    lenv_add_builtin(e, "deserialize", builtin_deserialize);
+
+    /* Data Functions */
+    lenv_add_builtin(e, "read-csv", builtin_read_csv);
+    lenv_add_builtin(e, "json-parse", builtin_json_parse);
+    lenv_add_builtin(e, "json-write", builtin_json_write);
+
+    /* File Functions */
+    lenv_add_builtin(e, "open", builtin_open);
+    lenv_add_builtin(e, "read-line", builtin_read_line);
+    lenv_add_builtin(e, "read-bytes", builtin_read_bytes);
+    lenv_add_builtin(e, "write", builtin_write);
+    lenv_add_builtin(e, "close", builtin_close);
+    lenv_add_builtin(e, "for-each-line", builtin_for_each_line);
+    lenv_add_builtin(e, "mmap-file", builtin_mmap_file);
+
+    /* String Functions */
+    lenv_add_builtin(e, "substr", builtin_substr);
+    lenv_add_builtin(e, "str-len", builtin_str_len);
+    lenv_add_builtin(e, "str-find", builtin_str_find);
+
+    /* Parallel Functions */
+    lenv_add_builtin(e, "pmap", builtin_pmap);
+    lenv_add_builtin(e, "pfor-each", builtin_pfor_each);
+    lenv_add_builtin(e, "future", builtin_future);
+    lenv_add_builtin(e, "await", builtin_await);
+    lenv_add_builtin(e, "freeze", builtin_freeze);
+
+    /* Isolate Functions */
+    lenv_add_builtin(e, "spawn", builtin_spawn);
+    lenv_add_builtin(e, "send", builtin_send);
+    lenv_add_builtin(e, "receive", builtin_receive);
+
+    /* Async Functions */
+    lenv_add_builtin(e, "async", builtin_async);
+    lenv_add_builtin(e, "await-io", builtin_await_io);
+    lenv_add_builtin(e, "sleep", builtin_sleep);
+
+    /* Generator Functions */
+    lenv_add_builtin(e, "gen", builtin_gen);
+    lenv_add_builtin(e, "yield", builtin_yield);
+    lenv_add_builtin(e, "next", builtin_next);
 }
 
 lval_t* lval_lambda(lval_t* formals, lval_t* body) {
-    lval_t* v = malloc(sizeof(lval_t));
+    lval_t* v = lval_alloc();
     v->type = LVAL_FUN;
 
     /* Set Builtin to Null */
@@ -992,6 +2386,10 @@ lval_t* builtin_lambda(lenv_t* e, lval_t* a) {
 lenv_t* lenv_copy(lenv_t* e) {
     lenv_t* n = malloc(sizeof(lenv_t));
     n->par = e->par;
+    n->trie = NULL;
+    n->boundary = e->boundary;
+    n->interp = e->interp;
+    n->lock = NULL;
     n->count = e->count;
     n->syms = malloc(sizeof(char*) * n->count);
     n->vals = malloc(sizeof(lval_t*) * n->count);
@@ -1003,9 +2401,35 @@ lenv_t* lenv_copy(lenv_t* e) {
     return n;
 }
 
+/**
+ * @brief
+ * This function copies bindings of environment and its parents up to the global one into a new environment,
+ * inner bindings hiding outer ones. The copy's parent is the global environment, so it outlives the caller's
+ * environments and isn't changed by them.
+*/
+lenv_t* lenv_snapshot(lenv_t* e) {
+    lenv_t* n = lenv_new();
+    n->interp = e->interp;
+    for (; e->par; e = e->par) {
+        for (int i = 0; i < e->count; i++) {
+            int hidden = 0;
+            for (int j = 0; j < n->count && !hidden; j++) { hidden = strcmp(n->syms[j], e->syms[i]) == 0; }
+            if (hidden) { continue; }
+            n->count++;
+            n->syms = realloc(n->syms, sizeof(char*) * n->count);
+            n->vals = realloc(n->vals, sizeof(lval_t*) * n->count);
+            n->syms[n->count-1] = malloc(strlen(e->syms[i]) + 1);
+            strcpy(n->syms[n->count-1], e->syms[i]);
+            n->vals[n->count-1] = lval_copy(e->vals[i]);
+        }
+    }
+    n->par = e;
+    return n;
+}
+
 void lenv_def(lenv_t* e, lval_t* k, lval_t* v) {
-        /* Iterate till e has no parent */
-        while (e->par) { e = e->par; }
+        /* Iterate till e has no parent or is a boundary of definitions */
+        while (e->par && !e->boundary) { e = e->par; }
         /* Put value in e */
         lenv_put(e, k, v);
 }
@@ -1027,6 +2451,9 @@ lval_t* builtin_var(lenv_t* e, lval_t* a, char* func) {
         "Got %i, Expected %i.", func, syms->count, a->count-1);
 
     for (int i = 0; i < syms->count; i++) {
+        /* Stored values must not pin big buffers through small slices */
+        lval_unpin(a->cell[i+1]);
+
         /* If 'def' define in globally. If 'put' define in locally */
         if (strcmp(func, "def") == 0) {
         lenv_def(e, syms->cell[i], a->cell[i+1]);
@@ -1045,6 +2472,15 @@ lval_t* lval_call(lenv_t* e, lval_t* f, lval_t* a) {
     
     /* If Builtin then simply apply that */
     if (f->builtin) { return f->builtin(e, a); }
+
+    /* Arguments are bound by changing the function, so frozen one is called through a copy */
+    if (lval_frozen(f)) {
+        lval_t* g = lval_thaw(lval_copy(f));
+        lval_t* res = lval_call(e, g, a);
+        lval_del(g);
+        return res;
+    }
+    f->formals = lval_thaw(f->formals);
     
     /* Record Argument Counts */
     int given = a->count;
@@ -1120,6 +2556,7 @@ lval_t* lval_call(lenv_t* e, lval_t* f, lval_t* a) {
     
         /* Set environment parent to evaluation environment */
         f->env->par = e;
+        f->env->interp = e->interp;
         
         /* Evaluate and return */
         return builtin_eval(f->env, 
@@ -1135,11 +2572,17 @@ char* ltype_name(int t) {
   switch(t) {
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
+    case LVAL_FLOAT: return "Float";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
     case LVAL_STR: return "String";
+    case LVAL_FILE: return "File";
+    case LVAL_FUTURE: return "Future";
+    case LVAL_ISOLATE: return "Isolate";
+    case LVAL_TASK: return "Task";
+    case LVAL_GEN: return "Generator";
     default: return "Unknown";
   }
 }
@@ -1192,7 +2635,12 @@ int lval_eq(lval_t* x, lval_t* y) {
         /* Compare String Values */
         case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
         case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+        case LVAL_STR: return x->len == y->len && memcmp(x->str, y->str, x->len) == 0;
+        case LVAL_FILE: return x->file == y->file;
+        case LVAL_FUTURE: return x->future == y->future;
+        case LVAL_ISOLATE: return x->mailbox == y->mailbox;
+        case LVAL_TASK: return x->task == y->task;
+        case LVAL_GEN: return x->gen == y->gen;
 
         /* If builtin compare, otherwise compare formals and body */
         case LVAL_FUN:
@@ -1245,34 +2693,42 @@ lval_t* builtin_if(lenv_t* e, lval_t* a) {
     LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
     LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
 
-    /* Mark Both Expressions as evaluable */
-    lval_t* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+    /* Take the first expression if condition is true, otherwise the second one */
+    lval_t* x = lval_thaw(lval_pop(a, a->cell[0]->num ? 1 : 2));
 
-    if (a->cell[0]->num) {
-        /* If condition is true evaluate first expression */
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        /* Otherwise evaluate second expression */
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+    /* Mark it as evaluable and evaluate */
+    x->type = LVAL_SEXPR;
+    x = lval_eval(e, x);
 
     /* Delete argument list and return */
     lval_del(a);
     return x;
 }
 
-void lval_print_str(lval_t* v) {
-    /* Make a Copy of the string */
-    char* escaped = malloc(strlen(v->str)+1);
-    strcpy(escaped, v->str);
-    /* Pass it through the escape function */
-    escaped = mpcf_escape(escaped);
-    /* Print it between " characters */
-    printf("\"%s\"", escaped);
-    /* free the copied string */
-    free(escaped);
+/**
+ * @brief
+ * This function prints string between " characters, escaping the same characters as mpcf_escape.
+ * Runs of characters without escapes are copied to the output buffer at once, nothing is allocated.
+*/
+void lval_print_str(linterp_t* it, lval_t* v) {
+    static const char escapes[256] = {
+        ['\a'] = 'a', ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r',
+        ['\t'] = 't', ['\v'] = 'v', ['\\'] = '\\', ['\''] = '\'', ['"'] = '"', ['\0'] = '0'
+    };
+
+    const unsigned char* s = (const unsigned char*)v->str;
+    const unsigned char* end = s + v->len;
+    lout_putc(it, '"');
+    while (s < end) {
+        const unsigned char* run = s;
+        while (s < end && !escapes[*s]) { s++; }
+        lout_write(it, (const char*)run, s - run);
+        if (s == end) { break; }
+
+        char esc[2] = {'\\', escapes[*s++]};
+        lout_write(it, esc, 2);
+    }
+    lout_putc(it, '"');
 }
 
 lval_t* lval_read_str(mpc_ast_t* t) {
@@ -1290,69 +2746,3633 @@ lval_t* lval_read_str(mpc_ast_t* t) {
     return str;
 }
 
+/**
+ * @brief
+ * This function loads and evaluates file: (load "path") or (load "path" threads).
+ * Files bigger than LLOAD_PARALLEL_MIN are parsed on one thread per CPU unless threads is given;
+ * threads 1 forces single-threaded parsing. Forms are always evaluated in file order.
+*/
 lval_t* builtin_load(lenv_t* e, lval_t* a) {
-    LASSERT_NUM("load", a, 1);
+    LASSERT(a, a->count == 1 || a->count == 2,
+        "Function 'load' passed incorrect number of arguments. "
+        "Got %i, Expected 1 or 2.", a->count);
     LASSERT_TYPE("load", a, 0, LVAL_STR);
+    if (a->count == 2) { LASSERT_TYPE("load", a, 1, LVAL_NUM); }
 
-    /* Parse File given by string name */
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, TinyLisp, &r)) {
+    lval_t* expr = lval_read_file(e->interp, lval_str_cstr(a->cell[0]), a->count == 2 ? (int)a->cell[1]->num : 0);
+    lval_del(a);
+    if (expr->type == LVAL_ERR) { return expr; }
+    lval_eval_forms(e, expr);
+
+    /* Return empty list */
+    return lval_sexpr();
+}
+
+/**
+ * @brief
+ * This function reads forms of source file for load, from its cache if that still matches the source,
+ * otherwise by parsing it with given number of threads (see builtin_load). Returns S-expression of forms or error.
+*/
+lval_t* lval_read_file(linterp_t* it, const char* path, int threads) {
+
+    /* Read whole file, its contents are needed both for hashing and parsing */
+    struct stat st;
+    size_t size;
+    char* contents = NULL;
+    if (stat(path, &st) == 0) { contents = lfile_read_all(path, &size); }
+    if (!contents) {
+        return lval_err("Could not load Library %s: error: Unable to open file!", path);
+    }
 
-        /* Read contents */
-        lval_t* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+    /* Reuse precompiled forms if the cache still matches the source */
+    uint32_t file = lsrc_register(path, contents, size);
+    uint64_t hash = lhash_bytes(contents, size);
+    lval_t* expr = lcache_load(path, &st, hash, file);
 
-        /* Evaluate each Expression */
-        while (expr->count) {
-        lval_t* x = lval_eval(e, lval_pop(expr, 0));
+    if (!expr) {
+        /* Parse contents and save read forms for the next load */
+        expr = lval_parse_source(it, path, contents, size, file, threads);
+        if (expr->type != LVAL_ERR) { lcache_store(path, &st, hash, expr); }
+    }
+    free(contents);
+    return expr;
+}
+
+//This function evaluates read forms of a loaded file in order, printing errors only, then deletes them.
+void lval_eval_forms(lenv_t* e, lval_t* forms) {
+    /* Popping from the front would move the rest of a big file every time */
+    for (int i = 0; i < forms->count; i++) {
+        lval_t* x = lval_eval(e, forms->cell[i]);
         /* If Evaluation leads to error print it */
-        if (x->type == LVAL_ERR) { lval_println(x); }
+        if (x->type == LVAL_ERR) { lval_println(e->interp, x); }
         lval_del(x);
-        }
-
-        /* Delete expressions and arguments */
-        lval_del(expr);
-        lval_del(a);
+    }
+    forms->count = 0;
+    lval_del(forms);
+}
 
-        /* Return empty list */
-        return lval_sexpr();
+//This function evaluates read forms in order, printing every result, then deletes them.
+void lval_eval_print(lenv_t* e, lval_t* forms) {
+    lprint_opts_t opts;
+    for (int i = 0; i < forms->count; i++) {
+        lval_t* x = lval_eval(e, forms->cell[i]);
+        lprint_opts_get(e, &opts);
+        lval_println_opts(e->interp, x, &opts);
+        lval_del(x);
+    }
+    forms->count = 0;
+    lval_del(forms);
+}
 
-    } else {
-        /* Get Parse Error as String */
+//This function parses input text (not a library) into S-expression of read forms, or returns error saying where parsing failed.
+lval_t* lval_parse_text(linterp_t* it, const char* name, const char* src, uint32_t file, size_t base) {
+    mpc_result_t r;
+    if (!mpc_parse(name, src, it->TinyLisp, &r)) {
+        lparse_err_locate(r.error, file, base);
         char* err_msg = mpc_err_string(r.error);
         mpc_err_delete(r.error);
-
-        /* Create new error message using it */
-        lval_t* err = lval_err("Could not load Library %s", err_msg);
+        err_msg[strcspn(err_msg, "\r\n")] = '\0';
+        lval_t* err = lval_err("Could not parse %s", err_msg);
         free(err_msg);
-        lval_del(a);
-
-        /* Cleanup and return error */
         return err;
     }
+
+    lval_t* forms = lval_read_src(r.output, file, base);
+    mpc_ast_delete(r.output);
+    return forms;
 }
 
-lval_t* builtin_print(lenv_t* e, lval_t* a) {
-    /* Print each argument followed by a space */
-    for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]); putchar(' ');
+/**
+ * @brief
+ * This function parses and evaluates n bytes of stream text at offset base one top-level form at a time.
+ * It is used once parsing them at once failed, so a bad form is reported alone and the others still run.
+ * Byte text[n] must exist, it is put back after use.
+*/
+static void lstream_eval_each(lenv_t* e, const char* name, char* text, size_t n, uint32_t file, size_t base) {
+    linterp_t* it = e->interp;
+    lscan_t scan;
+    lscan_init(&scan);
+    size_t start = 0;
+    int any = 0;
+    for (size_t i = 0; i <= n; i++) {
+        int boundary = i == n || lscan_feed(&scan, text + i, 1);
+        if (i < n && !strchr(" \t\n\r\v\f", text[i])) { any = 1; }
+        if (!boundary || !any) { continue; }
+
+        size_t end = i == n ? n : i + 1;
+        char keep = text[end];
+        text[end] = '\0';
+        lval_t* forms = lval_parse_text(it, name, text + start, file, base + start);
+        text[end] = keep;
+        if (forms->type == LVAL_ERR) {
+            lval_println(it, forms);
+            lval_del(forms);
+        } else {
+            lval_eval_print(e, forms);
+        }
+        start = end;
+        any = 0;
     }
-
-    /* Print a newline and delete arguments */
-    putchar('\n');
-    lval_del(a);
-
-    return lval_sexpr();
 }
 
-lval_t* builtin_error(lenv_t* e, lval_t* a) {
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
-
+/**
+ * @brief
+ * This function reads program from file descriptor (a pipe or redirected stdin) in big blocks and evaluates
+ * its forms as soon as they are complete, printing every result. Forms may span any number of lines.
+ * Output is flushed after every block, so a process at the other end of a pipe sees results of what it sent.
+ * Returns 0 if reading failed.
+*/
+int lval_run_stream(lenv_t* e, int fd, const char* name) {
+    linterp_t* it = e->interp;
+    uint32_t file = lsrc_register(name, "", 0);
+    lscan_t scan;
+    lscan_init(&scan);
+
+    /* buf holds text not evaluated yet, starting at offset base of the stream; scanned bytes of it were fed to scan */
+    lbuf_t buf;
+    lbuf_init(&buf);
+    size_t base = 0, scanned = 0;
+    int ok = 1, eof = 0;
+
+    while (!eof) {
+        lbuf_reserve(&buf, LSTREAM_READ_SIZE + 1);
+        ssize_t n = read(fd, buf.data + buf.len, LSTREAM_READ_SIZE);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0) { ok = 0; }
+        if (n <= 0) {
+            eof = 1;
+        } else {
+            lsrc_append(file, buf.data + buf.len, n, base + buf.len);
+            buf.len += n;
+        }
+
+        /* At end of input everything left is taken, so an unfinished form is reported by the parser */
+        size_t cut = eof ? buf.len : lscan_feed(&scan, buf.data + scanned, buf.len - scanned);
+        if (!eof) { cut = cut ? scanned + cut : 0; }
+        scanned = buf.len;
+        if (cut == 0) { continue; }
+
+        /* Parse complete forms in place, the byte after them is put back once they are read */
+        char keep = buf.data[cut];
+        buf.data[cut] = '\0';
+        lval_t* forms = lval_parse_text(it, name, buf.data, file, base);
+        buf.data[cut] = keep;
+
+        if (forms->type == LVAL_ERR) {
+            lval_del(forms);
+            lstream_eval_each(e, name, buf.data, cut, file, base);
+        } else {
+            lval_eval_print(e, forms);
+        }
+        lout_flush(it);
+
+        memmove(buf.data, buf.data + cut, buf.len - cut);
+        buf.len -= cut;
+        scanned -= cut;
+        base += cut;
+    }
+
+    lbuf_free(&buf);
+    return ok;
+}
+
+/**
+ * @brief
+ * This function parses and evaluates one line of input the way the REPL does: all its forms make one expression.
+ * Exactly one line is printed, the result or the error, so results can be matched to input lines.
+*/
+void lval_eval_line(lenv_t* e, const char* name, const char* line, uint32_t file, size_t base) {
+    lval_t* result = lval_parse_text(e->interp, name, line, file, base);
+    if (result->type != LVAL_ERR) { result = lval_eval(e, result); }
+
+    lprint_opts_t opts;
+    lprint_opts_get(e, &opts);
+    lval_println_opts(e->interp, result, &opts);
+    lval_del(result);
+}
+
+/**
+ * @brief
+ * This function evaluates lines [from, to) of batch text read by lval_run_batch, which keeps every line
+ * NUL-terminated at its offset in the file. Output is captured into out if it is given.
+*/
+static void lbatch_eval(lenv_t* e, const char* name, lbuf_t* text, size_t* starts, int from, int to, uint32_t file, lbuf_t* out) {
+    linterp_t* it = e->interp;
+    lbuf_t saved = it->out;
+    if (out) { it->out = *out; it->out_capture = 1; }
+    for (int k = from; k < to; k++) {
+        lval_eval_line(e, name, text->data + starts[k], file, starts[k]);
+    }
+    if (out) { it->out_capture = 0; *out = it->out; it->out = saved; }
+}
+
+/**
+ * @brief
+ * This function forks worker process of interpreter. Only the forking thread goes on in the child, so nothing
+ * may hold locks the child needs then: futures of the interpreter, which read its environment and would never
+ * run in the child, are waited for first, and the source table lock is held across fork. Isolates share no other
+ * locks with the interpreter. Returns what fork does, the child is reset by lfork_reset.
+*/
+static pid_t lfork(linterp_t* it) {
+    ljob_wait(it->futures);
+    pthread_mutex_lock(&lsrc_lock);
+    pid_t pid = fork();
+    pthread_mutex_unlock(&lsrc_lock);
+    if (pid == 0) { lfork_reset(); }
+    return pid;
+}
+
+/**
+ * @brief
+ * This function evaluates count lines of batch text on workers forked from this process, so everything loaded
+ * before is shared copy-on-write instead of being loaded again. Each worker takes a contiguous share of the lines
+ * and prints into its own pipe. Outputs are written in worker order while later ones are buffered, so they come
+ * out exactly as from one process, except that definitions made by a line are only seen in its own share.
+ * A share which could not get a worker is evaluated here. Returns 0 if a worker failed.
+*/
+static int lbatch_fork(lenv_t* e, const char* name, lbuf_t* text, size_t* starts, int count, uint32_t file, int workers) {
+    linterp_t* it = e->interp;
+    if (workers > count) { workers = count; }
+    pid_t* pids = calloc(workers, sizeof(pid_t));
+    int* fds = malloc(sizeof(int) * workers);
+    lbuf_t* outs = malloc(sizeof(lbuf_t) * workers);
+    lout_flush(it); //Nothing printed before may be copied into the workers.
+
+    for (int w = 0; w < workers; w++) {
+        int from = (int)((long)count * w / workers), to = (int)((long)count * (w + 1) / workers);
+        int p[2];
+        lbuf_init(&outs[w]);
+        fds[w] = -1;
+        if (pipe(p) == 0) {
+            pids[w] = lfork(it);
+            if (pids[w] == 0) {
+                for (int k = 0; k < w; k++) { if (fds[k] >= 0) { close(fds[k]); } }
+                close(p[0]);
+                it->out_file = fdopen(p[1], "w");
+                if (it->out_file) { lbatch_eval(e, name, text, starts, from, to, file, NULL); }
+                lout_flush(it);
+                _exit(0);
+            }
+            close(p[1]);
+            if (pids[w] > 0) { fds[w] = p[0]; } else { close(p[0]); pids[w] = 0; }
+        }
+        if (fds[w] < 0) { lbatch_eval(e, name, text, starts, from, to, file, &outs[w]); }
+    }
+
+    /* Output of the first unfinished worker is written as it comes, the others wait in their buffers */
+    struct pollfd* pfds = malloc(sizeof(struct pollfd) * workers);
+    int next = 0;
+    while (next < workers) {
+        int n = 0;
+        for (int w = next; w < workers; w++) {
+            if (fds[w] >= 0) { pfds[n].fd = fds[w]; pfds[n].events = POLLIN; pfds[n].revents = 0; n++; }
+        }
+        if (n > 0 && poll(pfds, n, -1) < 0 && errno != EINTR) { break; }
+
+        for (int k = 0, w = next; k < n; w++) {
+            if (fds[w] < 0) { continue; }
+            if (pfds[k++].revents) {
+                lbuf_reserve(&outs[w], LSTREAM_READ_SIZE);
+                ssize_t r = read(fds[w], outs[w].data + outs[w].len, LSTREAM_READ_SIZE);
+                if (r > 0) { outs[w].len += r; }
+                else if (r == 0 || (errno != EAGAIN && errno != EINTR)) { close(fds[w]); fds[w] = -1; }
+            }
+        }
+
+        while (next < workers) {
+            if (outs[next].len) { lout_write(it, outs[next].data, outs[next].len); }
+            outs[next].len = 0;
+            if (fds[next] >= 0) { break; }
+            next++;
+        }
+    }
+
+    int ok = 1;
+    for (int w = 0; w < workers; w++) {
+        if (fds[w] >= 0) { close(fds[w]); }
+        int st;
+        if (pids[w] > 0 && waitpid(pids[w], &st, 0) == pids[w] && !(WIFEXITED(st) && WEXITSTATUS(st) == 0)) {
+            lout_printf(it, "Error: batch worker %d failed\n", w + 1);
+            ok = 0;
+        }
+        lbuf_free(&outs[w]);
+    }
+    lout_flush(it);
+    free(pfds);
+    free(outs);
+    free(fds);
+    free(pids);
+    return ok;
+}
+
+//This function reports error which ended reading of batch file early. Returns 0 if there was one.
+static int lbatch_read_ok(linterp_t* it, lfile_t* f, const char* path) {
+    if (!f->err) { return 1; }
+    lout_printf(it, "Error: Could not read batch file %s: %s\n", path, strerror(f->err));
+    return 0;
+}
+
+/**
+ * @brief
+ * This function evaluates every line of file ("-" for stdin) as independent expression against the same
+ * environment, printing one result per line. Lines are streamed, so the file may be of any size.
+ * With more than one worker the whole file is read first and its lines are split between forked processes
+ * (see lbatch_fork). Returns 0 if the file could not be opened or read, or a worker failed.
+*/
+int lval_run_batch(lenv_t* e, const char* path, int workers) {
+    linterp_t* it = e->interp;
+    const char* name = strcmp(path, "-") == 0 ? "<stdin>" : path;
+    lfile_t* f = lfile_open(strcmp(path, "-") == 0 ? "/dev/stdin" : path, "r");
+    if (!f) {
+        lout_printf(it, "Error: Could not open batch file %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    /* Line table grows with every line read, so errors point to line and column of the batch file */
+    uint32_t file = lsrc_register(name, "", 0);
+    size_t base = 0, n;
+    char* line;
+    if (workers > 1) {
+        /* Every line keeps its offset in the file, ended by NUL instead of newline */
+        lbuf_t text;
+        lbuf_init(&text);
+        size_t* starts = NULL;
+        int count = 0, cap = 0;
+        while ((line = lfile_read_line(f, &n))) {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                starts = realloc(starts, sizeof(size_t) * cap);
+            }
+            starts[count++] = base;
+            lbuf_append(&text, line, n);
+            lbuf_putc(&text, '\0');
+            lsrc_append(file, "\n", 1, base + n);
+            base += n + 1;
+        }
+        int ok = lbatch_read_ok(it, f, path);
+        lfile_release(f);
+        ok = (count == 0 || lbatch_fork(e, name, &text, starts, count, file, workers)) && ok;
+        free(starts);
+        lbuf_free(&text);
+        return ok;
+    }
+
+    while ((line = lfile_read_line(f, &n))) {
+        lval_eval_line(e, name, line, file, base);
+        lsrc_append(file, "\n", 1, base + n);
+        base += n + 1;
+    }
+
+    int ok = lbatch_read_ok(it, f, path);
+    lfile_release(f);
+    return ok;
+}
+
+/**
+ * @brief
+ * This function creates Unix domain socket listening at path, replacing stale socket file.
+ * Anything else found at path is left alone and fails with EEXIST. Returns -1 on failure.
+*/
+int lserve_listen(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) { errno = ENAMETOOLONG; return -1; }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    int stale = lstat(path, &st) == 0;
+    if (stale && !S_ISSOCK(st.st_mode)) { errno = EEXIST; return -1; }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) { return -1; }
+    if (stale) { unlink(path); }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief
+ * This function answers every complete request buffered for connection, in order. A request is 4-byte big-endian
+ * length followed by that many bytes of source, evaluated as one line of the REPL in the connection's environment.
+ * The answer is framed the same way and holds everything printed while evaluating: output of print and
+ * the result (or error) line. Returns 0 if the client sent a request over LSERVE_MAX_REQUEST.
+*/
+int lserve_handle(lconn_t* c) {
+    size_t off = 0;
+    while (c->in.len - off >= 4) {
+        const unsigned char* h = (const unsigned char*)c->in.data + off;
+        size_t n = ((size_t)h[0] << 24) | ((size_t)h[1] << 16) | ((size_t)h[2] << 8) | h[3];
+        if (n > LSERVE_MAX_REQUEST) { return 0; }
+        if (c->in.len - off - 4 < n) { break; }
+
+        /* Source is terminated in place, the byte after it is put back once it is parsed */
+        char* src = c->in.data + off + 4;
+        char keep = src[n];
+        src[n] = '\0';
+
+        /* Output of the request is printed straight into the connection's buffer after room for the length */
+        size_t start = c->out.len;
+        lbuf_append(&c->out, "\0\0\0\0", 4);
+        linterp_t* it = c->env->interp;
+        lbuf_t saved = it->out;
+        it->out = c->out;
+        it->out_capture = 1;
+        lval_eval_line(c->env, "<request>", src, lsrc_register_text("<request>", src, n), 0);
+        it->out_capture = 0;
+        c->out = it->out;
+        it->out = saved;
+
+        size_t len = c->out.len - start - 4;
+        unsigned char* o = (unsigned char*)c->out.data + start;
+        o[0] = len >> 24; o[1] = len >> 16; o[2] = len >> 8; o[3] = len;
+
+        src[n] = keep;
+        off += 4 + n;
+    }
+
+    memmove(c->in.data, c->in.data + off, c->in.len - off);
+    c->in.len -= off;
+    return 1;
+}
+
+static volatile sig_atomic_t lserve_stop = 0;
+
+static void lserve_on_signal(int sig) {
+    (void)sig;
+    lserve_stop = 1;
+}
+
+static void lserve_close(lconn_t* c) {
+    close(c->fd);
+    lenv_del(c->env);
+    lbuf_free(&c->in);
+    lbuf_free(&c->out);
+}
+
+/**
+ * @brief
+ * This function serves clients of listening socket lfd until lserve_stop is set.
+ * One thread multiplexes all clients with poll. Clients may pipeline requests, answers come back in order.
+ * Definitions made by a client stay in its own environment, the global one (with everything loaded before)
+ * is shared read-only. A client with too much unread output is not read from until it catches up.
+*/
+static void lserve_loop(lenv_t* e, int lfd) {
+    linterp_t* it = e->interp;
+
+    /* Slot 0 of fds is the listening socket, slot i+1 belongs to conns[i] */
+    lconn_t* conns = NULL;
+    struct pollfd* fds = malloc(sizeof(struct pollfd));
+    int count = 0, cap = 0;
+
+    while (!lserve_stop) {
+        fds[0].fd = lfd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < count; i++) {
+            fds[i+1].fd = conns[i].fd;
+            fds[i+1].events = (conns[i].out.len - conns[i].sent < LSERVE_MAX_PENDING ? POLLIN : 0)
+                | (conns[i].out.len > conns[i].sent ? POLLOUT : 0);
+            fds[i+1].revents = 0;
+        }
+        if (poll(fds, count + 1, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+
+        /* Serve existing clients, closed ones are replaced by the last */
+        int n = count;
+        for (int i = n - 1; i >= 0; i--) {
+            lconn_t* c = &conns[i];
+            short ev = fds[i+1].revents;
+            int alive = !(ev & (POLLERR | POLLNVAL));
+
+            if (alive && (ev & (POLLIN | POLLHUP))) {
+                lbuf_reserve(&c->in, LSERVE_READ_SIZE + 1);
+                ssize_t r = read(c->fd, c->in.data + c->in.len, LSERVE_READ_SIZE);
+                if (r > 0) {
+                    c->in.len += r;
+                    alive = lserve_handle(c);
+                } else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    alive = 0;
+                }
+            }
+
+            if (alive && c->out.len > c->sent) {
+                ssize_t w = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (w > 0) { c->sent += w; }
+                else if (w < 0 && errno != EAGAIN && errno != EINTR) { alive = 0; }
+                if (c->sent == c->out.len) { c->sent = c->out.len = 0; }
+            }
+
+            if (!alive) {
+                lserve_close(c);
+                conns[i] = conns[--count];
+            }
+        }
+
+        /* Take new clients */
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                if (count == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    conns = realloc(conns, sizeof(lconn_t) * cap);
+                    fds = realloc(fds, sizeof(struct pollfd) * (cap + 1));
+                }
+                lconn_t* c = &conns[count++];
+                c->fd = fd;
+                c->env = lenv_new();
+                c->env->par = e;
+                c->env->boundary = 1;
+                c->env->interp = it;
+                lbuf_init(&c->in);
+                lbuf_init(&c->out);
+                c->sent = 0;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) { lserve_close(&conns[i]); }
+    free(conns);
+    free(fds);
+}
+
+/**
+ * @brief
+ * This function runs lserve_loop in workers forked from this process, all accepting clients of the same socket,
+ * so everything loaded before is shared copy-on-write (see lfork). Waits for the workers, asking them to stop on SIGINT or SIGTERM.
+ * Serves on this process if no worker could be started.
+*/
+static void lserve_fork(lenv_t* e, int lfd, int workers) {
+    pid_t* pids = calloc(workers, sizeof(pid_t));
+    int alive = 0;
+    for (int w = 0; w < workers; w++) {
+        pid_t pid = lfork(e->interp);
+        if (pid == 0) {
+            lserve_loop(e, lfd);
+            lout_flush(e->interp);
+            _exit(0);
+        }
+        if (pid > 0) { pids[alive++] = pid; }
+    }
+    if (alive == 0) { lserve_loop(e, lfd); }
+
+    int stopping = 0;
+    while (alive > 0) {
+        if (lserve_stop && !stopping) {
+            for (int w = 0; w < workers; w++) { if (pids[w] > 0) { kill(pids[w], SIGTERM); } }
+            stopping = 1;
+        }
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0 && errno == EINTR) { continue; }
+        if (pid < 0) { break; }
+        for (int w = 0; w < workers; w++) {
+            if (pids[w] == pid) { pids[w] = 0; alive--; }
+        }
+    }
+    free(pids);
+}
+
+/**
+ * @brief
+ * This function serves evaluation requests on Unix domain socket at path until SIGINT or SIGTERM (see lserve_loop),
+ * on this process or on given number of forked workers (see lserve_fork). Returns 0 if the socket could not be created.
+*/
+int lval_serve(lenv_t* e, const char* path, int workers) {
+    linterp_t* it = e->interp;
+    int lfd = lserve_listen(path);
+    if (lfd < 0) {
+        lout_printf(it, "Error: Could not listen on %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    struct sigaction sa, old_int, old_term, old_pipe;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lserve_on_signal;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, &old_pipe);
+    lserve_stop = 0;
+    lout_flush(it);
+
+    if (workers > 1) { lserve_fork(e, lfd, workers); } else { lserve_loop(e, lfd); }
+    close(lfd);
+    unlink(path);
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    return 1;
+}
+
+/**
+ * @brief
+ * This function moves position of parse error in source found at offset base of registered file
+ * to the true line and column of the file, mpc counts them from the start of the parsed text.
+*/
+static void lparse_err_locate(mpc_err_t* err, uint32_t file, size_t base) {
+    char* name;
+    long line, col;
+    if (base == 0 || base + err->state.pos > UINT32_MAX) { return; }
+    if (lsrc_locate(file, (uint32_t)(base + err->state.pos), &name, &line, &col)) {
+        err->state.row = line - 1;
+        err->state.col = col - 1;
+    }
+}
+
+//This function parses NUL-terminated source found at offset base of given file. Returns S-expression of read forms or error.
+lval_t* lval_parse_string(linterp_t* it, const char* name, const char* src, uint32_t file, size_t base) {
+    mpc_result_t r;
+    if (!mpc_parse(name, src, it->TinyLisp, &r)) {
+        /* Get Parse Error as String, positioned in the whole file */
+        lparse_err_locate(r.error, file, base);
+        char* err_msg = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+
+        /* Create new error message using it */
+        lval_t* err = lval_err("Could not load Library %s", err_msg);
+        free(err_msg);
+        return err;
+    }
+
+    lval_t* forms = lval_read_src(r.output, file, base);
+    mpc_ast_delete(r.output);
+    return forms;
+}
+
+void lscan_init(lscan_t* s) {
+    memset(s, 0, sizeof(*s));
+}
+
+/**
+ * @brief
+ * This function feeds n bytes to scanner. Returns offset in buf just after the last top-level boundary
+ * (whitespace, closing bracket or closing quote outside of any form), or 0 if there is none.
+ * Everything before a boundary consists of complete forms only.
+ * Unbalanced closing brackets are not counted, so they are left for the parser to report.
+*/
+size_t lscan_feed(lscan_t* s, const char* buf, size_t n) {
+    size_t cut = 0;
+    for (size_t i = 0; i < n; i++) {
+        char c = buf[i];
+        if (s->in_comment) {
+            if (c == '\n' || c == '\r') { s->in_comment = 0; }
+            else { continue; }
+        } else if (s->in_str) {
+            if (s->escape) { s->escape = 0; }
+            else if (c == '\\') { s->escape = 1; }
+            else if (c == '"') { s->in_str = 0; }
+            if (s->in_str || s->depth) { continue; }
+        } else {
+            switch (c) {
+                case '"': s->in_str = 1; continue;
+                case ';': s->in_comment = 1; continue;
+                case '(': case '{': s->depth++; continue;
+                case ')': case '}': if (s->depth) { s->depth--; } break;
+                case ' ': case '\t': case '\n': case '\r': case '\v': case '\f': break;
+                default: continue;
+            }
+        }
+
+        if (s->depth == 0) { cut = i + 1; }
+    }
+    return cut;
+}
+
+//This function parses one part of a file, it runs on its own thread.
+static void* lparse_job_run(void* arg) {
+    lparse_job_t* j = arg;
+    j->forms = lval_parse_string(j->interp, j->path, j->src, j->file, j->base);
+    return NULL;
+}
+
+/**
+ * @brief
+ * This function parses contents of registered source file into S-expression of read forms, or returns error.
+ * With threads > 1 (or 0 and a big file) the contents are cut at top-level form boundaries into
+ * roughly equal parts, which are parsed concurrently and joined back in their original order.
+ * Grammar parsers are only read while parsing, so they are shared by all threads.
+*/
+lval_t* lval_parse_source(linterp_t* it, const char* path, const char* contents, size_t size, uint32_t file, int threads) {
+    if (threads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (size >= LLOAD_PARALLEL_MIN && ncpu > 1) ? (int)ncpu : 1;
+    }
+    if (threads > LLOAD_MAX_THREADS) { threads = LLOAD_MAX_THREADS; }
+    if ((size_t)threads > size / LLOAD_CHUNK_MIN + 1) { threads = (int)(size / LLOAD_CHUNK_MIN + 1); }
+    if (threads <= 1) { return lval_parse_string(it, path, contents, file, 0); }
+
+    /* Cut contents at the last boundary before each of the evenly spaced targets */
+    lparse_job_t* jobs = calloc(threads, sizeof(lparse_job_t));
+    int count = 0;
+    lscan_t scan;
+    lscan_init(&scan);
+    size_t start = 0, fed = 0;
+    for (int k = 1; k <= threads; k++) {
+        size_t end = size;
+        if (k < threads) {
+            size_t target = size / threads * k;
+            size_t cut = lscan_feed(&scan, contents + fed, target - fed);
+            if (cut == 0 || fed + cut <= start) { fed = target; continue; }
+            end = fed + cut;
+            fed = target;
+        }
+
+        lparse_job_t* j = &jobs[count++];
+        j->interp = it;
+        j->path = path;
+        j->base = start;
+        j->file = file;
+        j->src = malloc(end - start + 1);
+        memcpy(j->src, contents + start, end - start);
+        j->src[end - start] = '\0';
+        start = end;
+    }
+
+    /* Parse the first part on this thread while others run */
+    pthread_t* tids = calloc(count, sizeof(pthread_t));
+    int* started = calloc(count, sizeof(int));
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&tids[i], NULL, lparse_job_run, &jobs[i]) == 0;
+        if (!started[i]) { lparse_job_run(&jobs[i]); }
+    }
+    lparse_job_run(&jobs[0]);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) { pthread_join(tids[i], NULL); }
+    }
+
+    /* Join parts, reporting the first error in file order */
+    lval_t* forms = NULL;
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        if (!forms && jobs[i].forms->type == LVAL_ERR) { forms = lval_copy(jobs[i].forms); }
+        if (jobs[i].forms->type != LVAL_ERR) { total += jobs[i].forms->count; }
+    }
+    if (!forms) {
+        forms = lval_sexpr();
+        forms->cell = malloc(sizeof(lval_t*) * (total ? total : 1));
+        for (int i = 0; i < count; i++) {
+            memcpy(forms->cell + forms->count, jobs[i].forms->cell, sizeof(lval_t*) * jobs[i].forms->count);
+            forms->count += jobs[i].forms->count;
+            jobs[i].forms->count = 0;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        lval_del(jobs[i].forms);
+        free(jobs[i].src);
+    }
+    free(jobs);
+    free(tids);
+    free(started);
+    return forms;
+}
+
+lval_t* builtin_print(lenv_t* e, lval_t* a) {
+    lprint_opts_t opts;
+    lprint_opts_get(e, &opts);
+
+    /* Print each argument followed by a space */
+    for (int i = 0; i < a->count; i++) {
+        lval_print_opts(e->interp, a->cell[i], &opts); lout_putc(e->interp, ' ');
+    }
+
+    /* Print a newline and delete arguments */
+    lout_putc(e->interp, '\n');
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+lval_t* builtin_error(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("error", a, 1);
+    LASSERT_TYPE("error", a, 0, LVAL_STR);
+
     /* Construct Error from first argument */
-    lval_t* err = lval_err(a->cell[0]->str);
+    lval_t* err = lval_err("%s", lval_str_cstr(a->cell[0]));
 
     /* Delete arguments and return */
     lval_del(a);
     return err;
-}
\ No newline at end of file
+}
+void lbuf_init(lbuf_t* b) {
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
+//This function makes sure there is room for n more bytes, growing the buffer geometrically.
+void lbuf_reserve(lbuf_t* b, size_t n) {
+    if (b->len + n <= b->cap) { return; }
+    size_t cap = b->cap ? b->cap : 64;
+    while (cap < b->len + n) { cap *= 2; }
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+}
+
+void lbuf_putc(lbuf_t* b, char c) {
+    lbuf_reserve(b, 1);
+    b->data[b->len++] = c;
+}
+
+void lbuf_append(lbuf_t* b, const void* data, size_t n) {
+    if (n == 0) { return; } //Empty buffer has no data pointer yet, memcpy mustn't get NULL.
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+void lbuf_free(lbuf_t* b) {
+    free(b->data);
+    lbuf_init(b);
+}
+
+void lout_putc(linterp_t* it, char c) {
+    lbuf_putc(&it->out, c);
+    if (it->out.len >= LOUT_FLUSH_SIZE) { lout_flush(it); }
+}
+
+void lout_write(linterp_t* it, const char* s, size_t n) {
+    lbuf_append(&it->out, s, n);
+    if (it->out.len >= LOUT_FLUSH_SIZE) { lout_flush(it); }
+}
+
+void lout_puts(linterp_t* it, const char* s) {
+    lout_write(it, s, strlen(s));
+}
+
+//This function formats directly into the output buffer. 
+void lout_printf(linterp_t* it, const char* fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    lbuf_reserve(&it->out, 64);
+    int n = vsnprintf(it->out.data + it->out.len, it->out.cap - it->out.len, fmt, va);
+    va_end(va);
+
+    /* Output didn't fit, format again with enough room */
+    if (n >= 0 && (size_t)n >= it->out.cap - it->out.len) {
+        lbuf_reserve(&it->out, n + 1);
+        va_start(va, fmt);
+        vsnprintf(it->out.data + it->out.len, it->out.cap - it->out.len, fmt, va);
+        va_end(va);
+    }
+    if (n > 0) { it->out.len += n; }
+    if (it->out.len >= LOUT_FLUSH_SIZE) { lout_flush(it); }
+}
+
+//This function writes everything buffered to stdout. 
+void lout_flush(linterp_t* it) {
+    if (it->out_capture) { return; }
+    if (it->out.len) {
+        fwrite(it->out.data, 1, it->out.len, it->out_file);
+        it->out.len = 0;
+    }
+    fflush(it->out_file);
+}
+
+//This function writes unsigned LEB128 varint: 7 bits per byte, high bit means "more bytes follow".
+void lbin_put_uvarint(lbuf_t* b, uint64_t x) {
+    lbuf_reserve(b, 10);
+    while (x >= 0x80) {
+        b->data[b->len++] = (char)((x & 0x7F) | 0x80);
+        x >>= 7;
+    }
+    b->data[b->len++] = (char)x;
+}
+
+//This function reads varint written by lbin_put_uvarint. Returns 0 on truncated or overlong input.
+int lbin_get_uvarint(const unsigned char** p, const unsigned char* end, uint64_t* x) {
+    uint64_t res = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end) { return 0; }
+        unsigned char c = *(*p)++;
+        res |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) { *x = res; return 1; }
+    }
+    return 0;
+}
+
+/**
+ * @brief
+ * This function tells whether value is worth numbering so that its repetitions are written as references.
+ * Lists are not shared when positions are written, as every occurrence of code has its own position.
+*/
+static int lval_dump_shareable(lval_t* v, int with_pos) {
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: return !with_pos && v->count > 0;
+        case LVAL_SYM: return strlen(v->sym) >= LSER_MIN_SHARED_STR;
+        case LVAL_STR: return v->len >= LSER_MIN_SHARED_STR;
+        default: return 0;
+    }
+}
+
+//This function mixes value into a running structural hash.
+static uint64_t lhash_mix(uint64_t h, uint64_t x) {
+    h ^= x + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+    return h * 1099511628211ULL;
+}
+
+/**
+ * @brief
+ * First encoder pass. Computes structural hash and subtree size of every node in the same
+ * pre-order the encoder writes them, so the encoder can find repeated subtrees
+ * and skip their nodes without hashing anything twice.
+*/
+static uint64_t lval_dump_prepare(ldump_t* d, lval_t* v) {
+    int idx = d->count++;
+    if (d->count > d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 256;
+        d->hashes = realloc(d->hashes, sizeof(uint64_t) * d->cap);
+        d->sizes = realloc(d->sizes, sizeof(int) * d->cap);
+    }
+
+    uint64_t h = lhash_mix(0, v->type);
+    switch (v->type) {
+        case LVAL_NUM: h = lhash_mix(h, (uint64_t)v->num); break;
+        case LVAL_FLOAT: {
+            uint64_t bits;
+            memcpy(&bits, &v->dnum, sizeof(bits));
+            h = lhash_mix(h, bits);
+            break;
+        }
+        case LVAL_ERR: h = lhash_mix(h, lhash_bytes(v->err, strlen(v->err))); break;
+        case LVAL_SYM: h = lhash_mix(h, lhash_bytes(v->sym, strlen(v->sym))); break;
+        case LVAL_STR: h = lhash_mix(h, lhash_bytes(v->str, v->len)); break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count; i++) { h = lhash_mix(h, lval_dump_prepare(d, v->cell[i])); }
+            break;
+        case LVAL_FUN:
+            if (v->builtin) {
+                h = lhash_mix(h, (uint64_t)(uintptr_t)v->builtin);
+            } else {
+                h = lhash_mix(h, lval_dump_prepare(d, v->formals));
+                h = lhash_mix(h, lval_dump_prepare(d, v->body));
+                for (int i = 0; i < v->env->count; i++) {
+                    h = lhash_mix(h, lval_dump_prepare(d, v->env->vals[i]));
+                }
+            }
+            break;
+        case LVAL_FILE:
+        case LVAL_FUTURE:
+        case LVAL_ISOLATE:
+        case LVAL_TASK:
+        case LVAL_GEN:
+            /* Handles have no encoding, lval_dump refuses them */
+            break;
+    }
+
+    d->hashes[idx] = h;
+    d->sizes[idx] = d->count - idx;
+    return h;
+}
+
+//This function looks for an already written value equal to v. Returns its id or -1, remembering v in the latter case.
+static long lval_dump_find_shared(ldump_t* d, lval_t* v, uint64_t h) {
+    if ((d->shared_count + 1) * 2 > d->shared_cap) {
+        /* Grow and rehash open addressing table */
+        int old_cap = d->shared_cap;
+        lshared_t* old = d->shared;
+        d->shared_cap = old_cap ? old_cap * 2 : 256;
+        d->shared = calloc(d->shared_cap, sizeof(lshared_t));
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i].node) { continue; }
+            size_t j = old[i].hash & (d->shared_cap - 1);
+            while (d->shared[j].node) { j = (j + 1) & (d->shared_cap - 1); }
+            d->shared[j] = old[i];
+        }
+        free(old);
+    }
+
+    size_t j = h & (d->shared_cap - 1);
+    while (d->shared[j].node) {
+        if (d->shared[j].hash == h && lval_eq(d->shared[j].node, v)) { return d->shared[j].id; }
+        j = (j + 1) & (d->shared_cap - 1);
+    }
+
+    d->shared[j].hash = h;
+    d->shared[j].node = v;
+    d->shared[j].id = d->shared_count++;
+    return -1;
+}
+
+//This function writes length-prefixed string. 
+static void lbin_put_str(lbuf_t* b, const char* s) {
+    size_t n = strlen(s);
+    lbin_put_uvarint(b, n);
+    lbuf_append(b, s, n);
+}
+
+//This function finds name under which builtin is bound in environment (or its parents).
+//Names are never freed while the environment lives, so the returned one stays valid.
+static char* lenv_builtin_name(lenv_t* e, lbuiltin f) {
+    for (; e; e = e->par) {
+        char* name = NULL;
+        if (e->lock) { pthread_rwlock_rdlock(e->lock); }
+        for (int i = 0; i < e->count && !name; i++) {
+            if (e->vals[i]->type == LVAL_FUN && e->vals[i]->builtin == f) { name = e->syms[i]; }
+        }
+        if (e->lock) { pthread_rwlock_unlock(e->lock); }
+        if (name) { return name; }
+    }
+    return NULL;
+}
+
+/**
+ * @brief
+ * This function appends binary encoding of value to buffer. Every value is a tag byte (value type) followed by:
+ * NUM - zigzag varint, FLOAT - 8 bytes little endian, ERR/SYM/STR - varint length and bytes,
+ * SEXPR/QEXPR - varint count and children, FUN - 0 and builtin name, or 1, formals, body,
+ * varint count and (name, value) pairs of the lambda environment.
+ * Non-empty lists and long strings are numbered in write order; a repeated one is written
+ * as LSER_TAG_REF and its number instead.
+ * With d->with_pos every tag is followed by varint source offset of the value.
+ * Returns 0 and sets d->err if value can't be encoded: a handle (File, Future, Isolate, Task, Generator)
+ * or builtin not bound in d->env.
+*/
+int lval_dump(ldump_t* d, lval_t* v) {
+    lbuf_t* b = d->buf;
+    int idx = d->cursor++;
+
+    if (lval_dump_shareable(v, d->with_pos)) {
+        long id = lval_dump_find_shared(d, v, d->hashes[idx]);
+        if (id >= 0) {
+            lbuf_putc(b, LSER_TAG_REF);
+            if (d->with_pos) { lbin_put_uvarint(b, v->src_pos); }
+            lbin_put_uvarint(b, (uint64_t)id);
+            d->cursor = idx + d->sizes[idx];
+            return 1;
+        }
+    }
+
+    lbuf_putc(b, (char)v->type);
+    if (d->with_pos) { lbin_put_uvarint(b, v->src_pos); }
+    switch (v->type) {
+        case LVAL_NUM:
+            lbin_put_uvarint(b, ((uint64_t)v->num << 1) ^ (uint64_t)(v->num >> 63));
+            return 1;
+        case LVAL_FLOAT: {
+            uint64_t bits;
+            memcpy(&bits, &v->dnum, sizeof(bits));
+            lbuf_reserve(b, 8);
+            for (int i = 0; i < 8; i++) { b->data[b->len++] = (char)(bits >> (8 * i)); }
+            return 1;
+        }
+        case LVAL_ERR: lbin_put_str(b, v->err); return 1;
+        case LVAL_SYM: lbin_put_str(b, v->sym); return 1;
+        case LVAL_STR:
+            lbin_put_uvarint(b, v->len);
+            lbuf_append(b, v->str, v->len);
+            return 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lbin_put_uvarint(b, v->count);
+            for (int i = 0; i < v->count; i++) {
+                if (!lval_dump(d, v->cell[i])) { return 0; }
+            }
+            return 1;
+        case LVAL_FUN:
+            if (v->builtin) {
+                char* name = lenv_builtin_name(d->env, v->builtin);
+                if (!name) { d->err = lval_err("cannot serialize unbound builtin"); return 0; }
+                lbuf_putc(b, 0);
+                lbin_put_str(b, name);
+                return 1;
+            }
+            lbuf_putc(b, 1);
+            if (!lval_dump(d, v->formals) || !lval_dump(d, v->body)) { return 0; }
+            lbin_put_uvarint(b, v->env->count);
+            for (int i = 0; i < v->env->count; i++) {
+                lbin_put_str(b, v->env->syms[i]);
+                if (!lval_dump(d, v->env->vals[i])) { return 0; }
+            }
+            return 1;
+        case LVAL_FILE:
+        case LVAL_FUTURE:
+        case LVAL_ISOLATE:
+        case LVAL_TASK:
+        case LVAL_GEN:
+            d->err = lval_err("cannot serialize %s", ltype_name(v->type));
+            return 0;
+    }
+    d->err = lval_err("cannot serialize value of unknown type");
+    return 0;
+}
+
+//This function reads length-prefixed string into malloc'ed NUL-terminated copy.
+static char* lbin_get_str(lundump_t* u) {
+    uint64_t n;
+    if (!lbin_get_uvarint(&u->p, u->end, &n) || n > (uint64_t)(u->end - u->p)) { return NULL; }
+    char* s = malloc(n + 1);
+    memcpy(s, u->p, n);
+    s[n] = '\0';
+    u->p += n;
+    return s;
+}
+
+//This function remembers decoded shared value under the next id, so later references can copy it.
+static uint64_t lval_undump_share(lundump_t* u, lval_t* v) {
+    if (u->shared_count == u->shared_cap) {
+        u->shared_cap = u->shared_cap ? u->shared_cap * 2 : 256;
+        u->shared = realloc(u->shared, sizeof(lval_t*) * u->shared_cap);
+    }
+    u->shared[u->shared_count] = v;
+    return u->shared_count++;
+}
+
+/**
+ * @brief
+ * This function reads value encoded by lval_dump. Returns NULL if input is malformed
+ * or nested deeper than LSER_MAX_DEPTH, which would exhaust the stack on untrusted input.
+*/
+lval_t* lval_undump(lundump_t* u) {
+    if (u->p >= u->end || u->depth >= LSER_MAX_DEPTH) { return NULL; }
+    int type = *u->p++;
+
+    /* Positions are relative to the file the decoded values are attributed to */
+    uint64_t pos = 0;
+    if (u->file && !lbin_get_uvarint(&u->p, u->end, &pos)) { return NULL; }
+
+    u->depth++;
+    lval_t* v = lval_undump_value(u, type);
+    u->depth--;
+    if (v && u->file) {
+        v->src_file = u->file;
+        v->src_pos = (uint32_t)pos;
+    }
+    return v;
+}
+
+//This function reads value of given type encoded by lval_dump, tag and position are already read.
+static lval_t* lval_undump_value(lundump_t* u, int type) {
+    uint64_t n;
+
+    switch (type) {
+        case LSER_TAG_REF:
+            /* Only finished values can be referenced, unfinished lists are still NULL */
+            if (!lbin_get_uvarint(&u->p, u->end, &n) || n >= u->shared_count || !u->shared[n]) { return NULL; }
+            return lval_copy(u->shared[n]);
+        case LVAL_NUM:
+            if (!lbin_get_uvarint(&u->p, u->end, &n)) { return NULL; }
+            return lval_num((long)((n >> 1) ^ (~(n & 1) + 1)));
+        case LVAL_FLOAT: {
+            if (u->end - u->p < 8) { return NULL; }
+            uint64_t bits = 0;
+            for (int i = 0; i < 8; i++) { bits |= (uint64_t)u->p[i] << (8 * i); }
+            u->p += 8;
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            return lval_float(d);
+        }
+        case LVAL_STR: {
+            /* Strings may hold NUL bytes, so length is kept as read */
+            if (!lbin_get_uvarint(&u->p, u->end, &n) || n > (uint64_t)(u->end - u->p)) { return NULL; }
+            lval_t* v = lval_str_len((const char*)u->p, n);
+            u->p += n;
+            if (lval_dump_shareable(v, u->file != 0)) { lval_undump_share(u, v); }
+            return v;
+        }
+        case LVAL_ERR:
+        case LVAL_SYM: {
+            char* s = lbin_get_str(u);
+            if (!s) { return NULL; }
+            lval_t* v = type == LVAL_ERR ? lval_err("%s", s) : lval_sym(s);
+            if (lval_dump_shareable(v, u->file != 0)) { lval_undump_share(u, v); }
+            free(s);
+            return v;
+        }
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: {
+            /* Every child takes at least two bytes, this rejects absurd counts before allocating */
+            if (!lbin_get_uvarint(&u->p, u->end, &n) || n > (uint64_t)(u->end - u->p)) { return NULL; }
+            lval_t* v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+            /* Lists are numbered only when lval_dump_shareable says so, otherwise ids get out of step */
+            int share = n > 0 && !u->file;
+            uint64_t id = share ? lval_undump_share(u, NULL) : 0;
+            v->cell = malloc(sizeof(lval_t*) * (n ? n : 1));
+            for (uint64_t i = 0; i < n; i++) {
+                lval_t* x = lval_undump(u);
+                if (!x) { lval_del(v); return NULL; }
+                v->cell[v->count++] = x;
+            }
+            if (share) { u->shared[id] = v; }
+            return v;
+        }
+        case LVAL_FUN: {
+            if (u->p >= u->end) { return NULL; }
+            if (*u->p++ == 0) {
+                /* Builtins are restored by name from the environment */
+                char* name = lbin_get_str(u);
+                if (!name || !u->env) { free(name); return NULL; }
+                lval_t* k = lval_sym(name);
+                lval_t* f = lenv_get(u->env, k);
+                lval_del(k);
+                free(name);
+                if (f->type != LVAL_FUN || !f->builtin) { lval_del(f); return NULL; }
+                return f;
+            }
+
+            lval_t* formals = lval_undump(u);
+            lval_t* body = formals ? lval_undump(u) : NULL;
+            if (!body || !lbin_get_uvarint(&u->p, u->end, &n) || n > (uint64_t)(u->end - u->p)) {
+                if (formals) { lval_del(formals); }
+                if (body) { lval_del(body); }
+                return NULL;
+            }
+
+            lval_t* f = lval_lambda(formals, body);
+            for (uint64_t i = 0; i < n; i++) {
+                char* name = lbin_get_str(u);
+                lval_t* x = name ? lval_undump(u) : NULL;
+                if (!x) { free(name); lval_del(f); return NULL; }
+                lval_t* k = lval_sym(name);
+                lenv_put(f->env, k, x);
+                lval_del(k); lval_del(x);
+                free(name);
+            }
+            return f;
+        }
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * @brief
+ * This function appends versioned binary encoding of value (header followed by lval_dump output) to buffer.
+ * Header is magic, version and flags byte, where LSER_FLAG_POS tells that source positions are included.
+ * Environment is used to name builtins and may be NULL when value contains no functions.
+ * Returns NULL, or error telling why value can't be encoded, leaving the buffer partially written.
+*/
+lval_t* lval_serialize(lbuf_t* b, lenv_t* e, lval_t* v, int with_pos) {
+    lbuf_append(b, LSER_MAGIC, 3);
+    lbuf_putc(b, LSER_VERSION);
+    lbuf_putc(b, with_pos ? LSER_FLAG_POS : 0);
+
+    ldump_t d;
+    memset(&d, 0, sizeof(d));
+    d.buf = b;
+    d.env = e;
+    d.with_pos = with_pos;
+    lval_dump_prepare(&d, v);
+    lval_dump(&d, v);
+
+    free(d.hashes);
+    free(d.sizes);
+    free(d.shared);
+    return d.err;
+}
+
+/**
+ * @brief
+ * This function decodes value written by lval_serialize. Returns NULL if data is malformed or of another version.
+ * Source positions, if present, are attributed to given file.
+*/
+lval_t* lval_deserialize(const char* data, size_t n, lenv_t* e, uint32_t file) {
+    if (n < 5 || memcmp(data, LSER_MAGIC, 3) != 0 || data[3] != LSER_VERSION) { return NULL; }
+    if ((data[4] & LSER_FLAG_POS) && !file) { return NULL; }
+
+    lundump_t u;
+    memset(&u, 0, sizeof(u));
+    u.p = (const unsigned char*)data + 5;
+    u.end = (const unsigned char*)data + n;
+    u.env = e;
+    u.file = (data[4] & LSER_FLAG_POS) ? file : 0;
+
+    lval_t* v = lval_undump(&u);
+    if (v && u.p != u.end) { lval_del(v); v = NULL; }
+
+    free(u.shared);
+    return v;
+}
+
+//This function computes 64-bit FNV-1a hash of given bytes. 
+uint64_t lhash_bytes(const char* data, size_t n) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+//This function reads whole file into NUL-terminated malloc'ed buffer. Returns NULL on failure.
+char* lfile_read_all(const char* path, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { return NULL; }
+
+    lbuf_t b;
+    lbuf_init(&b);
+    size_t n;
+    do {
+        lbuf_reserve(&b, 65536);
+        n = fread(b.data + b.len, 1, b.cap - b.len, f);
+        b.len += n;
+    } while (n > 0);
+
+    int failed = ferror(f);
+    fclose(f);
+    if (failed) { lbuf_free(&b); return NULL; }
+
+    lbuf_putc(&b, '\0');
+    *size = b.len - 1;
+    return b.data;
+}
+
+//This function builds the cache file name for given source file. 
+static char* lcache_path(const char* path) {
+    char* cpath = malloc(strlen(path) + strlen(LCACHE_EXT) + 1);
+    strcpy(cpath, path);
+    strcat(cpath, LCACHE_EXT);
+    return cpath;
+}
+
+//This function fills cache header describing current state of the source file. 
+static void lcache_hdr_fill(lcache_hdr_t* h, struct stat* st, uint64_t hash) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, LCACHE_MAGIC, 4);
+    h->version = LCACHE_VERSION;
+    h->size = (uint64_t)st->st_size;
+    h->mtime_sec = (int64_t)st->st_mtime;
+    h->mtime_nsec = (int64_t)LSTAT_MTIME_NSEC(st);
+    h->hash = hash;
+}
+
+/**
+ * @brief
+ * This function returns forms previously read from source file, if the cache next to it
+ * was written for exactly this size, mtime and content hash. Otherwise returns NULL.
+*/
+lval_t* lcache_load(const char* path, struct stat* st, uint64_t hash, uint32_t file) {
+    char* cpath = lcache_path(path);
+    size_t size;
+    char* data = lfile_read_all(cpath, &size);
+    free(cpath);
+    if (!data) { return NULL; }
+
+    lcache_hdr_t expect;
+    lcache_hdr_fill(&expect, st, hash);
+
+    lval_t* forms = NULL;
+    if (size > sizeof(lcache_hdr_t) && memcmp(data, &expect, sizeof(lcache_hdr_t)) == 0) {
+        forms = lval_deserialize(data + sizeof(lcache_hdr_t), size - sizeof(lcache_hdr_t), NULL, file);
+
+        /* Wrong root means the cache is damaged */
+        if (forms && forms->type != LVAL_SEXPR) { lval_del(forms); forms = NULL; }
+    }
+
+    free(data);
+    return forms;
+}
+
+/**
+ * @brief
+ * This function writes read forms of source file into its cache. Writing goes to temporary file
+ * which is renamed over the cache, so concurrent loads never see partial cache.
+ * Failures are ignored: the cache is only an optimisation.
+*/
+void lcache_store(const char* path, struct stat* st, uint64_t hash, lval_t* forms) {
+    lbuf_t b;
+    lbuf_init(&b);
+
+    lcache_hdr_t h;
+    lcache_hdr_fill(&h, st, hash);
+    lbuf_append(&b, &h, sizeof(h));
+
+    lval_t* err = lval_serialize(&b, NULL, forms, 1);
+    if (err) {
+        lval_del(err);
+    } else {
+        char* cpath = lcache_path(path);
+        char* tmp = malloc(strlen(cpath) + 8);
+        sprintf(tmp, "%s.XXXXXX", cpath);
+
+        /* Unique temporary file, loads of the same file on other threads or processes write their own */
+        int fd = mkstemp(tmp);
+        FILE* f = NULL;
+        if (fd >= 0) {
+            fchmod(fd, st->st_mode & 0666); //Cache is as readable as its source.
+            f = fdopen(fd, "wb");
+            if (!f) {
+                close(fd);
+                remove(tmp);
+            }
+        }
+        if (f) {
+            int ok = fwrite(b.data, 1, b.len, f) == b.len;
+            ok = (fclose(f) == 0) && ok;
+            if (!ok || rename(tmp, cpath) != 0) { remove(tmp); }
+        }
+        free(tmp);
+        free(cpath);
+    }
+
+    lbuf_free(&b);
+}
+
+//This function writes binary encoding of value into file: (serialize "path" value).
+lval_t* builtin_serialize(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("serialize", a, 2);
+    LASSERT_TYPE("serialize", a, 0, LVAL_STR);
+
+    lbuf_t b;
+    lbuf_init(&b);
+    lval_t* err = lval_serialize(&b, e, a->cell[1], 0);
+    if (err) {
+        lval_t* res = lval_err("Function 'serialize' %s.", err->err);
+        lval_del(err);
+        lbuf_free(&b);
+        lval_del(a);
+        return res;
+    }
+
+    FILE* f = fopen(lval_str_cstr(a->cell[0]), "wb");
+    int ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+    if (f) { ok = (fclose(f) == 0) && ok; }
+    lbuf_free(&b);
+
+    lval_t* res = ok ? lval_sexpr() : lval_err("Could not write file %s", a->cell[0]->str);
+    lval_del(a);
+    return res;
+}
+
+//This function reads value written by serialize: (deserialize "path").
+lval_t* builtin_deserialize(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("deserialize", a, 1);
+    LASSERT_TYPE("deserialize", a, 0, LVAL_STR);
+
+    size_t size;
+    char* data = lfile_read_all(lval_str_cstr(a->cell[0]), &size);
+    if (!data) {
+        lval_t* err = lval_err("Could not read file %s", a->cell[0]->str);
+        lval_del(a);
+        return err;
+    }
+
+    lval_t* v = lval_deserialize(data, size, e, 0);
+    free(data);
+
+    if (!v) { v = lval_err("File %s is not a serialized value of version %i", a->cell[0]->str, LSER_VERSION); }
+    lval_del(a);
+    return v;
+}
+
+/**
+ * @brief
+ * This function finds first delimiter, quote or line end starting at p, or returns end.
+ * Scans 8 bytes at a time: a byte equal to c gives zero in (word ^ c*0x01..01), and
+ * (x - 0x01..01) & ~x & 0x80..80 is nonzero exactly when x has a zero byte.
+*/
+static char* lcsv_scan(char* p, char* end, char delim) {
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    const uint64_t d = ones * (unsigned char)delim, q = ones * '"', n = ones * '\n', r = ones * '\r';
+
+    while (end - p >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        uint64_t x = w ^ d, y = w ^ q, z = w ^ n, t = w ^ r;
+        uint64_t hit = ((x - ones) & ~x) | ((y - ones) & ~y) | ((z - ones) & ~z) | ((t - ones) & ~t);
+        if (hit & highs) { break; }
+        p += 8;
+    }
+    while (p < end && *p != delim && *p != '"' && *p != '\n' && *p != '\r') { p++; }
+    return p;
+}
+
+//This function appends field to column, padding it with empty fields up to given row first.
+static void lcsv_col_push(lcsv_col_t* c, size_t row, char* field) {
+    static char empty[] = "";
+    while (c->count <= row) {
+        if (c->count == c->cap) {
+            c->cap = c->cap ? c->cap * 2 : 1024;
+            c->fields = realloc(c->fields, sizeof(char*) * c->cap);
+        }
+        c->fields[c->count++] = empty;
+    }
+    c->fields[row] = field;
+}
+
+//This function tells how fields of column can be represented: LVAL_NUM, LVAL_FLOAT or LVAL_STR.
+static int lcsv_col_type(lcsv_col_t* c, size_t from) {
+    int type = LVAL_NUM;
+    for (size_t i = from; i < c->count; i++) {
+        char* f = c->fields[i];
+        char* end;
+        if (*f == '\0') { type = LVAL_FLOAT; continue; }
+        if (type == LVAL_NUM) {
+            errno = 0;
+            strtol(f, &end, 10);
+            if (*end == '\0' && errno != ERANGE) { continue; }
+            type = LVAL_FLOAT;
+        }
+        strtod(f, &end);
+        if (*end != '\0') { return LVAL_STR; }
+    }
+    return type;
+}
+
+/**
+ * @brief
+ * This function reads CSV file into columns: (read-csv "path" [delimiter [header [infer]]]).
+ * Delimiter defaults to ",", header and infer to 1. Result is Q-expression with {name {values}} for every column,
+ * named by the header row, or by column number without it. With inference, a column whose fields are all integers
+ * holds Numbers, all numbers (empty fields are NaN) - Floats, otherwise Strings.
+ * Quoted fields may contain delimiters, line breaks and "" for a quote.
+*/
+lval_t* builtin_read_csv(lenv_t* e, lval_t* a) {
+    LASSERT(a, a->count >= 1 && a->count <= 4,
+        "Function 'read-csv' passed incorrect number of arguments. "
+        "Got %i, Expected 1 to 4.", a->count);
+    LASSERT_TYPE("read-csv", a, 0, LVAL_STR);
+    if (a->count > 1) {
+        LASSERT_TYPE("read-csv", a, 1, LVAL_STR);
+        LASSERT(a, a->cell[1]->len == 1,
+            "Function 'read-csv' delimiter must be a single character.");
+    }
+    if (a->count > 2) { LASSERT_TYPE("read-csv", a, 2, LVAL_NUM); }
+    if (a->count > 3) { LASSERT_TYPE("read-csv", a, 3, LVAL_NUM); }
+
+    char delim = a->count > 1 ? a->cell[1]->str[0] : ',';
+    int header = a->count > 2 ? a->cell[2]->num != 0 : 1;
+    int infer = a->count > 3 ? a->cell[3]->num != 0 : 1;
+
+    size_t size;
+    char* data = lfile_read_all(lval_str_cstr(a->cell[0]), &size);
+    if (!data) {
+        lval_t* err = lval_err("Could not read file %s", a->cell[0]->str);
+        lval_del(a);
+        return err;
+    }
+
+    /* Split buffer in place: every field is terminated by NUL written over its delimiter */
+    lcsv_col_t* cols = NULL;
+    size_t ncols = 0, rows = 0;
+    char* p = data;
+    char* end = data + size;
+    while (p < end) {
+        /* Skip blank lines */
+        if (*p == '\n' || *p == '\r') { p++; continue; }
+
+        size_t col = 0;
+        int row_end = 0;
+        while (!row_end) {
+            char* field = p;
+            if (p < end && *p == '"') {
+                /* Quoted field, unescape "" while moving it one byte left */
+                char* w = field;
+                p++;
+                while (p < end) {
+                    if (*p == '"') {
+                        if (p + 1 < end && p[1] == '"') { *w++ = '"'; p += 2; continue; }
+                        p++;
+                        break;
+                    }
+                    *w++ = *p++;
+                }
+                p = lcsv_scan(p, end, delim);
+                *w = '\0';
+            } else {
+                p = lcsv_scan(p, end, delim);
+                while (p < end && *p == '"') { p = lcsv_scan(p + 1, end, delim); }
+            }
+
+            if (p >= end || *p != delim) {
+                row_end = 1;
+                if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n') { *p++ = '\0'; }
+            }
+            if (p < end) { *p++ = '\0'; }
+
+            if (col == ncols) {
+                cols = realloc(cols, sizeof(lcsv_col_t) * ++ncols);
+                memset(&cols[col], 0, sizeof(lcsv_col_t));
+            }
+            lcsv_col_push(&cols[col++], rows, field);
+        }
+        rows++;
+    }
+
+    /* Build columns, each list is allocated once with its final size */
+    size_t first = header ? 1 : 0;
+    lval_t* res = lval_qexpr();
+    res->cell = malloc(sizeof(lval_t*) * (ncols ? ncols : 1));
+    for (size_t c = 0; c < ncols; c++) {
+        lcsv_col_t* col = &cols[c];
+        if (col->count < rows) { lcsv_col_push(col, rows - 1, ""); }
+
+        int type = infer ? lcsv_col_type(col, first) : LVAL_STR;
+        lval_t* vals = lval_qexpr();
+        vals->cell = malloc(sizeof(lval_t*) * (rows > first ? rows - first : 1));
+        for (size_t i = first; i < rows; i++) {
+            char* f = col->fields[i];
+            switch (type) {
+                case LVAL_NUM: vals->cell[vals->count++] = lval_num(strtol(f, NULL, 10)); break;
+                case LVAL_FLOAT: vals->cell[vals->count++] = lval_float(*f ? strtod(f, NULL) : NAN); break;
+                default: vals->cell[vals->count++] = lval_str(f); break;
+            }
+        }
+
+        lval_t* name = header && rows > 0 ? lval_str(col->fields[0]) : lval_num((long)c);
+        res->cell[res->count++] = lval_add(lval_add(lval_qexpr(), name), vals);
+        free(col->fields);
+    }
+
+    free(cols);
+    free(data);
+    lval_del(a);
+    return res;
+}
+
+//This function skips JSON whitespace.
+static void ljson_ws(ljson_t* j) {
+    while (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r') { j->p++; }
+}
+
+//This function records the first JSON syntax error. Always returns NULL.
+static lval_t* ljson_fail(ljson_t* j, const char* what) {
+    if (!j->err) { j->err = what; }
+    return NULL;
+}
+
+//This function reads 4 hex digits of \u escape. Returns -1 on malformed input.
+static long ljson_hex4(ljson_t* j) {
+    long x = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *j->p++;
+        x <<= 4;
+        if (c >= '0' && c <= '9') { x |= c - '0'; }
+        else if (c >= 'a' && c <= 'f') { x |= c - 'a' + 10; }
+        else if (c >= 'A' && c <= 'F') { x |= c - 'A' + 10; }
+        else { return -1; }
+    }
+    return x;
+}
+
+//This function reads JSON string (opening quote is current character) into malloc'ed UTF-8 string.
+static char* ljson_read_str(ljson_t* j) {
+    j->p++;
+
+    /* Unescaped strings are copied in one go */
+    const char* s = j->p;
+    while (*j->p != '"' && *j->p != '\\' && (unsigned char)*j->p >= 0x20) { j->p++; }
+
+    lbuf_t b;
+    lbuf_init(&b);
+    lbuf_append(&b, s, j->p - s);
+
+    while (*j->p != '"') {
+        unsigned char c = (unsigned char)*j->p++;
+        if (c < 0x20) { lbuf_free(&b); j->p--; ljson_fail(j, "unescaped control character or end of input in string"); return NULL; }
+        if (c != '\\') { lbuf_putc(&b, (char)c); continue; }
+
+        char* out = NULL;
+        switch (*j->p++) {
+            case '"': out = "\""; break;
+            case '\\': out = "\\"; break;
+            case '/': out = "/"; break;
+            case 'b': out = "\b"; break;
+            case 'f': out = "\f"; break;
+            case 'n': out = "\n"; break;
+            case 'r': out = "\r"; break;
+            case 't': out = "\t"; break;
+            case 'u': {
+                long cp = ljson_hex4(j);
+                if (cp >= 0xD800 && cp <= 0xDBFF && j->p[0] == '\\' && j->p[1] == 'u') {
+                    j->p += 2;
+                    long lo = ljson_hex4(j);
+                    cp = (lo >= 0xDC00 && lo <= 0xDFFF) ? 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00) : -1;
+                }
+                if (cp <= 0 || (cp >= 0xD800 && cp <= 0xDFFF)) {
+                    lbuf_free(&b);
+                    ljson_fail(j, cp == 0 ? "\\u0000 can't be held by a string" : "invalid \\u escape");
+                    return NULL;
+                }
+                /* Encode code point as UTF-8 */
+                if (cp < 0x80) { lbuf_putc(&b, (char)cp); }
+                else if (cp < 0x800) { lbuf_putc(&b, (char)(0xC0 | (cp >> 6))); lbuf_putc(&b, (char)(0x80 | (cp & 0x3F))); }
+                else if (cp < 0x10000) {
+                    lbuf_putc(&b, (char)(0xE0 | (cp >> 12)));
+                    lbuf_putc(&b, (char)(0x80 | ((cp >> 6) & 0x3F)));
+                    lbuf_putc(&b, (char)(0x80 | (cp & 0x3F)));
+                } else {
+                    lbuf_putc(&b, (char)(0xF0 | (cp >> 18)));
+                    lbuf_putc(&b, (char)(0x80 | ((cp >> 12) & 0x3F)));
+                    lbuf_putc(&b, (char)(0x80 | ((cp >> 6) & 0x3F)));
+                    lbuf_putc(&b, (char)(0x80 | (cp & 0x3F)));
+                }
+                continue;
+            }
+            default:
+                lbuf_free(&b);
+                j->p--;
+                ljson_fail(j, "invalid escape in string");
+                return NULL;
+        }
+        lbuf_putc(&b, *out);
+    }
+    j->p++;
+
+    lbuf_putc(&b, '\0');
+    return b.data;
+}
+
+//This function reads JSON number as Number if it is integer fitting long, otherwise as Float.
+static lval_t* ljson_read_num(ljson_t* j) {
+    const char* s = j->p;
+    if (*j->p == '-') { j->p++; }
+    if (*j->p < '0' || *j->p > '9') { return ljson_fail(j, "invalid number"); }
+    if (*j->p == '0') { j->p++; } else { while (*j->p >= '0' && *j->p <= '9') { j->p++; } }
+
+    int integer = 1;
+    if (*j->p == '.') {
+        integer = 0;
+        j->p++;
+        if (*j->p < '0' || *j->p > '9') { return ljson_fail(j, "invalid number"); }
+        while (*j->p >= '0' && *j->p <= '9') { j->p++; }
+    }
+    if (*j->p == 'e' || *j->p == 'E') {
+        integer = 0;
+        j->p++;
+        if (*j->p == '+' || *j->p == '-') { j->p++; }
+        if (*j->p < '0' || *j->p > '9') { return ljson_fail(j, "invalid number"); }
+        while (*j->p >= '0' && *j->p <= '9') { j->p++; }
+    }
+
+    if (integer) {
+        errno = 0;
+        long x = strtol(s, NULL, 10);
+        if (errno != ERANGE) { return lval_num(x); }
+    }
+    return lval_float(strtod(s, NULL));
+}
+
+/**
+ * @brief
+ * This function reads one JSON value. Objects become Q-expressions of {"key" value} pairs, arrays - Q-expressions,
+ * true and false - 1 and 0, null - (). Returns NULL and sets j->err on malformed input.
+*/
+lval_t* ljson_read(ljson_t* j) {
+    ljson_ws(j);
+    switch (*j->p) {
+        case '{':
+        case '[': {
+            char close = *j->p == '{' ? '}' : ']';
+            if (++j->depth > LJSON_MAX_DEPTH) { return ljson_fail(j, "nesting too deep"); }
+            j->p++;
+
+            lval_t* v = lval_qexpr();
+            ljson_ws(j);
+            if (*j->p == close) { j->p++; j->depth--; return v; }
+            while (1) {
+                lval_t* x;
+                if (close == '}') {
+                    ljson_ws(j);
+                    if (*j->p != '"') { lval_del(v); return ljson_fail(j, "expected object key"); }
+                    char* key = ljson_read_str(j);
+                    if (!key) { lval_del(v); return NULL; }
+                    ljson_ws(j);
+                    if (*j->p != ':') { free(key); lval_del(v); return ljson_fail(j, "expected ':'"); }
+                    j->p++;
+                    lval_t* val = ljson_read(j);
+                    if (!val) { free(key); lval_del(v); return NULL; }
+                    x = lval_add(lval_add(lval_qexpr(), lval_str_own(key)), val);
+                } else {
+                    x = ljson_read(j);
+                    if (!x) { lval_del(v); return NULL; }
+                }
+                lval_add(v, x);
+
+                ljson_ws(j);
+                if (*j->p == ',') { j->p++; continue; }
+                if (*j->p == close) { j->p++; break; }
+                lval_del(v);
+                return ljson_fail(j, close == '}' ? "expected ',' or '}'" : "expected ',' or ']'");
+            }
+            j->depth--;
+            return v;
+        }
+        case '"': {
+            char* str = ljson_read_str(j);
+            return str ? lval_str_own(str) : NULL;
+        }
+        case 't':
+            if (strncmp(j->p, "true", 4) == 0) { j->p += 4; return lval_num(1); }
+            break;
+        case 'f':
+            if (strncmp(j->p, "false", 5) == 0) { j->p += 5; return lval_num(0); }
+            break;
+        case 'n':
+            if (strncmp(j->p, "null", 4) == 0) { j->p += 4; return lval_sexpr(); }
+            break;
+        default:
+            if (*j->p == '-' || (*j->p >= '0' && *j->p <= '9')) { return ljson_read_num(j); }
+            break;
+    }
+    return ljson_fail(j, "expected value");
+}
+
+//This function parses JSON text: (json-parse "text").
+lval_t* builtin_json_parse(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("json-parse", a, 1);
+    LASSERT_TYPE("json-parse", a, 0, LVAL_STR);
+
+    ljson_t j;
+    j.start = j.p = lval_str_cstr(a->cell[0]);
+    j.err = NULL;
+    j.depth = 0;
+
+    lval_t* v = ljson_read(&j);
+    if (v) {
+        ljson_ws(&j);
+        if (*j.p != '\0') { lval_del(v); v = ljson_fail(&j, "expected end of input"); }
+    }
+    if (!v) {
+        v = lval_err("Function 'json-parse' passed invalid JSON at offset %ld: %s.",
+            (long)(j.p - j.start), j.err);
+    }
+
+    lval_del(a);
+    return v;
+}
+
+//This function writes n bytes of string as JSON string literal. 
+static void ljson_write_str(lbuf_t* b, const char* s, size_t n) {
+    const char* end = s + n;
+    lbuf_putc(b, '"');
+    while (s < end) {
+        /* Copy runs of characters that need no escaping at once */
+        const char* run = s;
+        while (s < end && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) { s++; }
+        lbuf_append(b, run, s - run);
+        if (s == end) { break; }
+
+        char c = *s++;
+        switch (c) {
+            case '"': lbuf_append(b, "\\\"", 2); break;
+            case '\\': lbuf_append(b, "\\\\", 2); break;
+            case '\n': lbuf_append(b, "\\n", 2); break;
+            case '\r': lbuf_append(b, "\\r", 2); break;
+            case '\t': lbuf_append(b, "\\t", 2); break;
+            default: {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)c);
+                lbuf_append(b, esc, 6);
+            }
+        }
+    }
+    lbuf_putc(b, '"');
+}
+
+//This function tells whether Q-expression is written as JSON object: non-empty and made of {"key" value} pairs.
+static int ljson_is_object(lval_t* v) {
+    if (v->count == 0) { return 0; }
+    for (int i = 0; i < v->count; i++) {
+        lval_t* x = v->cell[i];
+        if (x->type != LVAL_QEXPR || x->count != 2 || x->cell[0]->type != LVAL_STR) { return 0; }
+    }
+    return 1;
+}
+
+/**
+ * @brief
+ * This function appends JSON text of value to buffer. Q-expressions of {"key" value} pairs are written as objects,
+ * other lists as arrays, () as null, symbols as strings; non-finite floats become null.
+ * Returns 0 for values with no JSON form (functions, errors).
+*/
+int ljson_write(lbuf_t* b, lval_t* v) {
+    char num[32];
+    switch (v->type) {
+        case LVAL_NUM:
+            lbuf_append(b, num, snprintf(num, sizeof(num), "%ld", v->num));
+            return 1;
+        case LVAL_FLOAT:
+            if (!isfinite(v->dnum)) { lbuf_append(b, "null", 4); return 1; }
+            lbuf_append(b, num, snprintf(num, sizeof(num), "%.17g", v->dnum));
+            return 1;
+        case LVAL_STR: ljson_write_str(b, v->str, v->len); return 1;
+        case LVAL_SYM: ljson_write_str(b, v->sym, strlen(v->sym)); return 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: {
+            if (v->type == LVAL_SEXPR && v->count == 0) { lbuf_append(b, "null", 4); return 1; }
+            int object = v->type == LVAL_QEXPR && ljson_is_object(v);
+            lbuf_putc(b, object ? '{' : '[');
+            for (int i = 0; i < v->count; i++) {
+                if (i) { lbuf_putc(b, ','); }
+                if (object) {
+                    ljson_write_str(b, v->cell[i]->cell[0]->str, v->cell[i]->cell[0]->len);
+                    lbuf_putc(b, ':');
+                    if (!ljson_write(b, v->cell[i]->cell[1])) { return 0; }
+                } else if (!ljson_write(b, v->cell[i])) {
+                    return 0;
+                }
+            }
+            lbuf_putc(b, object ? '}' : ']');
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+//This function returns JSON text of value as string: (json-write value).
+lval_t* builtin_json_write(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("json-write", a, 1);
+
+    lbuf_t b;
+    lbuf_init(&b);
+    if (!ljson_write(&b, a->cell[0])) {
+        lbuf_free(&b);
+        lval_del(a);
+        return lval_err("Function 'json-write' passed value with no JSON form.");
+    }
+    lbuf_putc(&b, '\0');
+
+    lval_del(a);
+    return lval_str_own(b.data);
+}
+
+//This function creates structure referring to file handle, taking over one reference.
+lval_t* lval_file(lfile_t* f) {
+    lval_t* v = lval_alloc();
+    v->type = LVAL_FILE;
+    v->file = f;
+    return v;
+}
+
+//This function opens file with mode "r", "w" or "a". Returns NULL and sets errno on failure.
+lfile_t* lfile_open(const char* path, const char* mode) {
+    int flags;
+    if (strcmp(mode, "r") == 0) { flags = O_RDONLY; }
+    else if (strcmp(mode, "w") == 0) { flags = O_WRONLY | O_CREAT | O_TRUNC; }
+    else if (strcmp(mode, "a") == 0) { flags = O_WRONLY | O_CREAT | O_APPEND; }
+    else { errno = EINVAL; return NULL; }
+
+    int fd = open(path, flags | O_CLOEXEC, 0666);
+    if (fd < 0) { return NULL; }
+
+    /* Pipes, sockets and terminals don't block, so coroutines can wait for them in the event loop */
+    struct stat st;
+    if (fstat(fd, &st) == 0 && !S_ISREG(st.st_mode)) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); }
+
+    lfile_t* f = malloc(sizeof(lfile_t));
+    f->fd = fd;
+    f->refs = 1;
+    f->writable = flags != O_RDONLY;
+    f->eof = 0;
+    f->err = 0;
+    f->path = malloc(strlen(path) + 1);
+    strcpy(f->path, path);
+    f->cap = LFILE_BUF_SIZE;
+    f->buf = malloc(f->cap);
+    f->pos = 0;
+    f->len = 0;
+    pthread_mutex_init(&f->lock, NULL);
+    f->holder = NULL;
+    f->waiters = NULL;
+    return f;
+}
+
+//This function writes out buffered output. Returns 0 on failure.
+static int lfile_flush(lfile_t* f) {
+    size_t done = 0;
+    while (done < f->len) {
+        ssize_t n = write(f->fd, f->buf + done, f->len - done);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && errno == EAGAIN) { lio_wait(f->fd, EPOLLOUT); continue; }
+        if (n <= 0) { f->len = 0; return 0; }
+        done += n;
+    }
+    f->len = 0;
+    return 1;
+}
+
+/**
+ * @brief
+ * This function flushes and closes file, the handle stays until its last value is deleted. Returns 0 on failure.
+ * Like the other operations of a shared handle it is called with the file locked.
+*/
+int lfile_close(lfile_t* f) {
+    if (f->fd < 0) { return 1; }
+    int ok = !f->writable || lfile_flush(f);
+    ok = (close(f->fd) == 0) && ok;
+    __atomic_store_n(&f->fd, -1, __ATOMIC_RELAXED); //Printing reads it without the lock.
+    return ok;
+}
+
+//This function drops one reference to file, closing it with the last one.
+void lfile_release(lfile_t* f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    lfile_close(f);
+    pthread_mutex_destroy(&f->lock);
+    free(f->path);
+    free(f->buf);
+    free(f);
+}
+
+//This function reads more input into buffer, keeping unread bytes. Returns number of bytes read, 0 at end of file, -1 on error (kept in err).
+static ssize_t lfile_fill(lfile_t* f) {
+    if (f->pos > 0) {
+        memmove(f->buf, f->buf + f->pos, f->len - f->pos);
+        f->len -= f->pos;
+        f->pos = 0;
+    }
+    if (f->len == f->cap) {
+        f->cap *= 2;
+        f->buf = realloc(f->buf, f->cap);
+    }
+
+    ssize_t n;
+    while (1) {
+        n = read(f->fd, f->buf + f->len, f->cap - f->len);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0 && errno == EAGAIN) { lio_wait(f->fd, EPOLLIN); continue; }
+        break;
+    }
+    if (n < 0) { f->err = errno; }
+    if (n <= 0) { f->eof = 1; return n; }
+    f->len += n;
+    return n;
+}
+
+/**
+ * @brief
+ * This function returns next line (without line end) as pointer into the file buffer, valid until next read.
+ * Line is NUL-terminated over its line end. Returns NULL at end of file or on error (see err).
+*/
+char* lfile_read_line(lfile_t* f, size_t* n) {
+    size_t scanned = f->pos;
+    while (1) {
+        char* nl = memchr(f->buf + scanned, '\n', f->len - scanned);
+        if (nl || (f->eof && f->pos < f->len)) {
+            char* line = f->buf + f->pos;
+            size_t len = nl ? (size_t)(nl - line) : f->len - f->pos;
+            f->pos += nl ? len + 1 : len;
+            if (len > 0 && line[len-1] == '\r') { len--; }
+
+            /* Unterminated last line may fill the buffer, make room for NUL */
+            if (!nl && f->len == f->cap) {
+                ptrdiff_t off = line - f->buf;
+                f->cap++;
+                f->buf = realloc(f->buf, f->cap);
+                line = f->buf + off;
+            }
+            line[len] = '\0';
+            *n = len;
+            return line;
+        }
+        if (f->eof) { return NULL; }
+
+        size_t kept = f->len - f->pos;
+        if (lfile_fill(f) < 0) { return NULL; }
+        scanned = kept;
+    }
+}
+
+//This function appends data to output buffer, writing it out when full. Returns 0 on failure.
+int lfile_write(lfile_t* f, const char* data, size_t n) {
+    if (f->len + n > f->cap && !lfile_flush(f)) { return 0; }
+    if (n >= f->cap) {
+        /* Big writes bypass the buffer */
+        while (n > 0) {
+            ssize_t w = write(f->fd, data, n);
+            if (w < 0 && errno == EINTR) { continue; }
+            if (w < 0 && errno == EAGAIN) { lio_wait(f->fd, EPOLLOUT); continue; }
+            if (w <= 0) { return 0; }
+            data += w;
+            n -= w;
+        }
+        return 1;
+    }
+    memcpy(f->buf + f->len, data, n);
+    f->len += n;
+    return 1;
+}
+
+//This function checks that argument is File open for reading (or writing).
+static lval_t* lfile_check(char* func, lval_t* a, int index, int writable) {
+    lfile_t* f = a->cell[index]->file;
+    if (f->fd < 0) { return lval_err("Function '%s' passed closed file %s.", func, f->path); }
+    if (f->writable != writable) {
+        return lval_err("Function '%s' passed file %s not open for %s.", func, f->path, writable ? "writing" : "reading");
+    }
+    return NULL;
+}
+
+//This function opens file: (open "path" "r"|"w"|"a"), mode defaults to "r".
+lval_t* builtin_open(lenv_t* e, lval_t* a) {
+    LASSERT(a, a->count == 1 || a->count == 2,
+        "Function 'open' passed incorrect number of arguments. "
+        "Got %i, Expected 1 or 2.", a->count);
+    LASSERT_TYPE("open", a, 0, LVAL_STR);
+    if (a->count == 2) { LASSERT_TYPE("open", a, 1, LVAL_STR); }
+
+    lfile_t* f = lfile_open(lval_str_cstr(a->cell[0]), a->count == 2 ? lval_str_cstr(a->cell[1]) : "r");
+    lval_t* res = f ? lval_file(f) : lval_err("Could not open file %s: %s", a->cell[0]->str, strerror(errno));
+    lval_del(a);
+    return res;
+}
+
+//This function reads next line of file without its line end: (read-line file). Returns () at end of file, error if reading failed.
+lval_t* builtin_read_line(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("read-line", a, 1);
+    LASSERT_TYPE("read-line", a, 0, LVAL_FILE);
+    lfile_t* f = a->cell[0]->file;
+    lfile_lock(f);
+    lval_t* res = lfile_check("read-line", a, 0, 0);
+    if (!res) {
+        size_t n;
+        char* line = lfile_read_line(f, &n);
+        if (line) {
+            res = lval_str_len(line, n);
+        } else {
+            res = f->err ? lval_err("Could not read file %s: %s", f->path, strerror(f->err)) : lval_sexpr();
+        }
+    }
+    lfile_unlock(f);
+    lval_del(a);
+    return res;
+}
+
+/**
+ * @brief
+ * This function reads up to n bytes of file: (read-bytes file n). Returns () at end of file, error if reading failed.
+*/
+lval_t* builtin_read_bytes(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("read-bytes", a, 2);
+    LASSERT_TYPE("read-bytes", a, 0, LVAL_FILE);
+    LASSERT_TYPE("read-bytes", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num >= 0, "Function 'read-bytes' passed negative count.");
+    lfile_t* f = a->cell[0]->file;
+    lfile_lock(f);
+    lval_t* err = lfile_check("read-bytes", a, 0, 0);
+    if (err) { lfile_unlock(f); lval_del(a); return err; }
+
+    size_t want = (size_t)a->cell[1]->num;
+    while (f->len - f->pos < want && !f->eof) {
+        if (lfile_fill(f) < 0) { break; }
+    }
+
+    size_t n = f->len - f->pos < want ? f->len - f->pos : want;
+    lval_t* res;
+    if (n == 0 && want > 0) {
+        res = f->err ? lval_err("Could not read file %s: %s", f->path, strerror(f->err)) : lval_sexpr();
+    } else {
+        res = lval_str_len(f->buf + f->pos, n);
+        f->pos += n;
+    }
+    lfile_unlock(f);
+    lval_del(a);
+    return res;
+}
+
+//This function writes strings to file: (write file "str" ...). Returns number of bytes written.
+lval_t* builtin_write(lenv_t* e, lval_t* a) {
+    LASSERT(a, a->count >= 1,
+        "Function 'write' passed incorrect number of arguments. "
+        "Got %i, Expected at least 1.", a->count);
+    LASSERT_TYPE("write", a, 0, LVAL_FILE);
+    for (int i = 1; i < a->count; i++) { LASSERT_TYPE("write", a, i, LVAL_STR); }
+    lfile_t* f = a->cell[0]->file;
+    lfile_lock(f);
+    lval_t* err = lfile_check("write", a, 0, 1);
+    if (err) { lfile_unlock(f); lval_del(a); return err; }
+
+    long total = 0;
+    for (int i = 1; i < a->count; i++) {
+        size_t n = a->cell[i]->len;
+        if (!lfile_write(f, a->cell[i]->str, n)) {
+            err = lval_err("Could not write file %s: %s", f->path, strerror(errno));
+            lfile_unlock(f);
+            lval_del(a);
+            return err;
+        }
+        total += n;
+    }
+
+    lfile_unlock(f);
+    lval_del(a);
+    return lval_num(total);
+}
+
+//This function closes file, writing out buffered output: (close file).
+lval_t* builtin_close(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("close", a, 1);
+    LASSERT_TYPE("close", a, 0, LVAL_FILE);
+
+    lfile_t* f = a->cell[0]->file;
+    lfile_lock(f);
+    lval_t* res = lfile_close(f) ? lval_sexpr() : lval_err("Could not close file %s: %s", f->path, strerror(errno));
+    lfile_unlock(f);
+    lval_del(a);
+    return res;
+}
+
+/**
+ * @brief
+ * This function calls function with every line of file: (for-each-line file-or-path fn).
+ * Only the current line is kept in memory. A path is opened and closed by the call.
+ * Returns () or the first error returned by fn or met reading the file.
+*/
+lval_t* builtin_for_each_line(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("for-each-line", a, 2);
+    LASSERT(a, a->cell[0]->type == LVAL_FILE || a->cell[0]->type == LVAL_STR,
+        "Function 'for-each-line' passed incorrect type for argument 0. "
+        "Got %s, Expected %s or %s.",
+        ltype_name(a->cell[0]->type), ltype_name(LVAL_FILE), ltype_name(LVAL_STR));
+    LASSERT_TYPE("for-each-line", a, 1, LVAL_FUN);
+
+    lfile_t* f;
+    if (a->cell[0]->type == LVAL_STR) {
+        f = lfile_open(lval_str_cstr(a->cell[0]), "r");
+        if (!f) {
+            lval_t* err = lval_err("Could not open file %s: %s", a->cell[0]->str, strerror(errno));
+            lval_del(a);
+            return err;
+        }
+    } else {
+        lval_t* err = lfile_check("for-each-line", a, 0, 0);
+        if (err) { lval_del(a); return err; }
+        f = a->cell[0]->file;
+        __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    }
+
+    lval_t* res = NULL;
+    while (!res) {
+        /* The file is locked only while reading, fn may use it too */
+        lfile_lock(f);
+        size_t n;
+        char* line = f->fd >= 0 ? lfile_read_line(f, &n) : NULL;
+        lval_t* s = line ? lval_str_len(line, n) : NULL;
+        if (!s && f->err) { res = lval_err("Could not read file %s: %s", f->path, strerror(f->err)); }
+        lfile_unlock(f);
+        if (!s) { break; }
+
+        /* Calling binds arguments into the function, so every call gets a fresh copy */
+        lval_t* fn = lval_copy(a->cell[1]);
+        lval_t* x = lval_call(e, fn, lval_add(lval_sexpr(), s));
+        lval_del(fn);
+        if (x->type == LVAL_ERR) { res = x; } else { lval_del(x); }
+    }
+
+    lfile_release(f);
+    lval_del(a);
+    return res ? res : lval_sexpr();
+}
+
+/**
+ * @brief
+ * This function maps file into memory and returns its contents as string slice: (mmap-file "path").
+ * Nothing is copied; substrings of the result share the mapping, which is unmapped with the last of them.
+*/
+lval_t* builtin_mmap_file(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("mmap-file", a, 1);
+    LASSERT_TYPE("mmap-file", a, 0, LVAL_STR);
+
+    char* path = lval_str_cstr(a->cell[0]);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        lval_t* err = lval_err("Could not open file %s: %s", path, strerror(errno));
+        if (fd >= 0) { close(fd); }
+        lval_del(a);
+        return err;
+    }
+
+    /* Empty files cannot be mapped */
+    if (st.st_size == 0) {
+        close(fd);
+        lval_del(a);
+        return lval_str("");
+    }
+
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        lval_t* err = lval_err("Could not map file %s: %s", path, strerror(errno));
+        lval_del(a);
+        return err;
+    }
+
+    lstrbuf_t* b = malloc(sizeof(lstrbuf_t));
+    b->refs = 0;
+    b->mapped = 1;
+    b->data = data;
+    b->size = st.st_size;
+    lval_del(a);
+    return lval_slice(b, data, b->size);
+}
+
+/**
+ * @brief
+ * This function returns part of string: (substr "str" start len). len is cut at end of string.
+ * Substrings of slices share their buffer. An owned string gives up its buffer to the substring when the
+ * substring is at least a quarter of it, otherwise bytes are copied.
+*/
+lval_t* builtin_substr(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("substr", a, 3);
+    LASSERT_TYPE("substr", a, 0, LVAL_STR);
+    LASSERT_TYPE("substr", a, 1, LVAL_NUM);
+    LASSERT_TYPE("substr", a, 2, LVAL_NUM);
+
+    lval_t* s = a->cell[0];
+    long start = a->cell[1]->num;
+    long n = a->cell[2]->num;
+    LASSERT(a, start >= 0 && (size_t)start <= s->len,
+        "Function 'substr' passed start out of range. Got %li, Expected 0 to %li.", start, (long)s->len);
+    LASSERT(a, n >= 0, "Function 'substr' passed negative length.");
+    if ((size_t)n > s->len - start) { n = s->len - start; }
+
+    lval_t* res;
+    if (s->owner) {
+        res = lval_slice(s->owner, s->str + start, n);
+    } else if ((size_t)n * 4 >= s->len && n > 0 && !lval_frozen(s)) {
+        lstrbuf_t* b = malloc(sizeof(lstrbuf_t));
+        b->refs = 0;
+        b->mapped = 0;
+        b->data = s->str;
+        b->size = s->len + 1;
+        s->str = NULL;
+        s->len = 0;
+        s->owner = NULL;
+        res = lval_slice(b, b->data + start, n);
+    } else {
+        res = lval_str_len(s->str + start, n);
+    }
+
+    lval_del(a);
+    return res;
+}
+
+//This function returns length of string in bytes: (str-len "str").
+lval_t* builtin_str_len(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("str-len", a, 1);
+    LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+    long n = a->cell[0]->len;
+    lval_del(a);
+    return lval_num(n);
+}
+
+//This function returns byte offset of first occurrence of needle in string at or after start, or -1: (str-find "str" "needle" [start]).
+lval_t* builtin_str_find(lenv_t* e, lval_t* a) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function 'str-find' passed incorrect number of arguments. "
+        "Got %i, Expected 2 or 3.", a->count);
+    LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+    LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+    if (a->count == 3) { LASSERT_TYPE("str-find", a, 2, LVAL_NUM); }
+
+    lval_t* s = a->cell[0];
+    lval_t* needle = a->cell[1];
+    long start = a->count == 3 ? a->cell[2]->num : 0;
+    LASSERT(a, start >= 0 && (size_t)start <= s->len,
+        "Function 'str-find' passed start out of range. Got %li, Expected 0 to %li.", start, (long)s->len);
+
+    char* hit = memmem(s->str + start, s->len - start, needle->str, needle->len);
+    long res = hit ? hit - s->str : -1;
+    lval_del(a);
+    return lval_num(res);
+}
+
+lpool_t lpool;
+pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+__thread int lpool_self = -1; //Index of pool worker running on this thread, -1 for other threads.
+
+//This function adds task to the bottom of deque.
+static void ldeque_push(ldeque_t* d, ltask_t t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom == d->cap) {
+        /* Reuse room left by stolen tasks before growing */
+        if (d->top > 0) {
+            memmove(d->tasks, d->tasks + d->top, sizeof(ltask_t) * (d->bottom - d->top));
+            d->bottom -= d->top;
+            d->top = 0;
+        } else {
+            d->cap = d->cap ? d->cap * 2 : 64;
+            d->tasks = realloc(d->tasks, sizeof(ltask_t) * d->cap);
+        }
+    }
+    d->tasks[d->bottom++] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+//This function takes task from the bottom (owner) or the top (thief) of deque. Returns 0 if it's empty.
+static int ldeque_pop(ldeque_t* d, ltask_t* t, int steal) {
+    pthread_mutex_lock(&d->lock);
+    int ok = d->top < d->bottom;
+    if (ok) {
+        *t = steal ? d->tasks[d->top++] : d->tasks[--d->bottom];
+        if (d->top == d->bottom) { d->top = d->bottom = 0; }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+//This function runs tasks of pool worker, sleeping while there are none.
+static void* lpool_worker(void* arg) {
+    lpool_self = (int)(intptr_t)arg;
+    ltask_t t;
+    while (1) {
+        if (lpool_take(&t)) { t.run(t.arg); continue; }
+        pthread_mutex_lock(&lpool.lock);
+        while (__atomic_load_n(&lpool.queued, __ATOMIC_ACQUIRE) == 0) { pthread_cond_wait(&lpool.wake, &lpool.lock); }
+        pthread_mutex_unlock(&lpool.lock);
+    }
+    return NULL;
+}
+
+//This function starts pool workers. Thread count (workers and the waiting thread) is number of CPUs or LISP_THREADS.
+static void lpool_init(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    char* env = getenv("LISP_THREADS");
+    if (env && atol(env) > 0) { ncpu = atol(env); }
+    int n = ncpu > 1 ? (int)ncpu - 1 : 0;
+    if (n > LPOOL_MAX_WORKERS) { n = LPOOL_MAX_WORKERS; }
+
+    pthread_mutex_init(&lpool.lock, NULL);
+    pthread_cond_init(&lpool.wake, NULL);
+    lpool.queued = 0;
+    lpool.next = 0;
+    lpool.deques = calloc(n ? n : 1, sizeof(ldeque_t));
+    lpool.nworkers = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&lpool.deques[i].lock, NULL);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, lpool_worker, (void*)(intptr_t)i) != 0) { break; }
+        pthread_detach(tid);
+        lpool.nworkers++;
+    }
+}
+
+//This function returns the process thread pool, starting it on first use. It may have no workers on one CPU.
+lpool_t* lpool_get(void) {
+    pthread_once(&lpool_once, lpool_init);
+    return &lpool;
+}
+
+//This function queues task: on the own deque of a worker, spread round robin from other threads.
+void lpool_submit(ltask_t t) {
+    int i = lpool_self >= 0 ? lpool_self : (int)(__atomic_fetch_add(&lpool.next, 1, __ATOMIC_RELAXED) % lpool.nworkers);
+    ldeque_push(&lpool.deques[i], t);
+    __atomic_add_fetch(&lpool.queued, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&lpool.lock);
+    pthread_cond_signal(&lpool.wake);
+    pthread_mutex_unlock(&lpool.lock);
+}
+
+//This function takes a task to run: newest of own deque first, then steals oldest of the others. Returns 0 if there is none.
+int lpool_take(ltask_t* t) {
+    if (__atomic_load_n(&lpool.queued, __ATOMIC_ACQUIRE) == 0) { return 0; }
+    int n = lpool.nworkers;
+    int self = lpool_self;
+    int found = self >= 0 && ldeque_pop(&lpool.deques[self], t, 0);
+    for (int k = 1; !found && k <= n; k++) {
+        int victim = ((self >= 0 ? self : 0) + k) % n;
+        found = ldeque_pop(&lpool.deques[victim], t, 1);
+    }
+    if (found) { __atomic_sub_fetch(&lpool.queued, 1, __ATOMIC_RELAXED); }
+    return found;
+}
+
+void ljob_init(ljob_t* j, int n) {
+    j->remaining = n;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->done, NULL);
+}
+
+//This function counts down under the lock, so the job isn't destroyed by its waiter while being signalled.
+void ljob_finish(ljob_t* j) {
+    pthread_mutex_lock(&j->lock);
+    if (__atomic_sub_fetch(&j->remaining, 1, __ATOMIC_ACQ_REL) == 0) { pthread_cond_broadcast(&j->done); }
+    pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * @brief
+ * This function waits for all tasks of job, running queued tasks meanwhile. It sleeps only when nothing
+ * is queued, then all unfinished tasks of the job are running on other threads, so tree-shaped jobs of pmap
+ * can't deadlock. Futures may wait for each other in any order, await uses ljob_block instead.
+*/
+void ljob_wait(ljob_t* j) {
+    ltask_t t;
+    while (__atomic_load_n(&j->remaining, __ATOMIC_ACQUIRE) > 0 && lpool_take(&t)) { t.run(t.arg); }
+    ljob_block(j);
+}
+
+//This function sleeps until all tasks of job are finished. It takes the lock even then, so the last ljob_finish has let go of the job.
+void ljob_block(ljob_t* j) {
+    pthread_mutex_lock(&j->lock);
+    while (__atomic_load_n(&j->remaining, __ATOMIC_ACQUIRE) > 0) { pthread_cond_wait(&j->done, &j->lock); }
+    pthread_mutex_unlock(&j->lock);
+}
+
+void ljob_destroy(ljob_t* j) {
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->done);
+}
+
+/**
+ * @brief
+ * This function maps part of list. Every call gets its own copy of the function and is evaluated in a fresh
+ * environment which is a def boundary, so nothing shared is written. Output goes to the part's own buffer.
+*/
+static void lpmap_run(void* arg) {
+    lpmap_chunk_t* c = arg;
+    linterp_t it = *c->env->interp;
+    it.out = c->output;
+    it.out_capture = 1;
+
+    lenv_t* w = lenv_new();
+    w->par = c->env;
+    w->boundary = 1;
+    w->interp = &it;
+    for (int i = c->start; i < c->end; i++) {
+        lval_t* fn = lval_copy(c->fn);
+        c->out[i] = lval_call(w, fn, lval_add(lval_sexpr(), lval_copy(c->in[i])));
+        lval_del(fn);
+    }
+    lenv_del(w);
+
+    c->output = it.out;
+    ljob_finish(c->job);
+}
+
+/**
+ * @brief
+ * This function applies function to every element of list on the thread pool: (func fn {list} [chunk]).
+ * The list is cut into parts of chunk elements (by default about LPMAP_CHUNKS_PER_THREAD parts per thread)
+ * and the parts are run as pool tasks while the calling thread waits and helps. Short lists, or a pool without
+ * workers, are mapped on the calling thread. The caller's environments are only read while this runs.
+ * Output printed by the function appears in list order. Returns Q-expression of results or the first error.
+*/
+lval_t* lval_pmap(lenv_t* e, lval_t* a, char* func) {
+    LASSERT(a, a->count == 2 || a->count == 3,
+        "Function '%s' passed incorrect number of arguments. "
+        "Got %i, Expected 2 or 3.", func, a->count);
+    LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+    if (a->count == 3) {
+        LASSERT_TYPE(func, a, 2, LVAL_NUM);
+        LASSERT(a, a->cell[2]->num > 0, "Function '%s' passed chunk size below 1.", func);
+    }
+
+    lpool_t* pool = lpool_get();
+    lval_t* list = a->cell[1];
+    int n = list->count;
+    int threads = pool->nworkers + 1;
+    long chunk = a->count == 3 ? a->cell[2]->num : n / (threads * LPMAP_CHUNKS_PER_THREAD) + 1;
+    if (n < LPMAP_MIN || pool->nworkers == 0) { chunk = n ? n : 1; }
+    int nchunks = (int)((n + chunk - 1) / chunk);
+
+    lval_t** out = calloc(n ? n : 1, sizeof(lval_t*));
+    lpmap_chunk_t* chunks = calloc(nchunks ? nchunks : 1, sizeof(lpmap_chunk_t));
+    ljob_t job;
+    ljob_init(&job, nchunks);
+    for (int k = 0; k < nchunks; k++) {
+        lpmap_chunk_t* c = &chunks[k];
+        c->env = e;
+        c->fn = a->cell[0];
+        c->in = list->cell;
+        c->out = out;
+        c->start = (int)(k * chunk);
+        c->end = (int)((k + 1) * chunk < n ? (k + 1) * chunk : n);
+        lbuf_init(&c->output);
+        c->job = &job;
+    }
+
+    /* The first part is kept for this thread, it would take it anyway */
+    for (int k = 1; k < nchunks; k++) { lpool_submit((ltask_t){lpmap_run, &chunks[k]}); }
+    if (nchunks > 0) { lpmap_run(&chunks[0]); }
+    ljob_wait(&job);
+    ljob_destroy(&job);
+
+    for (int k = 0; k < nchunks; k++) {
+        lout_write(e->interp, chunks[k].output.data, chunks[k].output.len);
+        lbuf_free(&chunks[k].output);
+    }
+    free(chunks);
+
+    /* Collect results, the first error (in list order) wins */
+    lval_t* res = lval_qexpr();
+    for (int i = 0; i < n; i++) {
+        if (res->type != LVAL_ERR && out[i]->type == LVAL_ERR) {
+            lval_del(res);
+            res = out[i];
+        } else if (res->type == LVAL_ERR) {
+            lval_del(out[i]);
+        } else {
+            lval_add(res, out[i]);
+        }
+    }
+    free(out);
+    lval_del(a);
+    return res;
+}
+
+//This function maps function over list in parallel: (pmap fn {list} [chunk]).
+lval_t* builtin_pmap(lenv_t* e, lval_t* a) {
+    return lval_pmap(e, a, "pmap");
+}
+
+//This function calls function with every element of list in parallel: (pfor-each fn {list} [chunk]). Returns () or the first error.
+lval_t* builtin_pfor_each(lenv_t* e, lval_t* a) {
+    lval_t* res = lval_pmap(e, a, "pfor-each");
+    if (res->type == LVAL_ERR) { return res; }
+    lval_del(res);
+    return lval_sexpr();
+}
+
+/**
+ * @brief
+ * This function drops one reference to future. The running task holds one too, so it's freed after finishing.
+ * Output of a future nobody awaited is written out to the output file then, so it isn't lost.
+*/
+void lfuture_release(lfuture_t* f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    if (!f->printed && f->interp.out.len) {
+        fwrite(f->interp.out.data, 1, f->interp.out.len, f->interp.out_file);
+        fflush(f->interp.out_file);
+    }
+    lval_del(f->result);
+    lenv_del(f->env);
+    lbuf_free(&f->interp.out);
+    ljob_destroy(&f->job);
+    free(f);
+}
+
+//This function evaluates expression of future, for whoever set its started flag.
+static void lfuture_eval(lfuture_t* f) {
+    f->result = lval_eval(f->env, f->expr);
+    f->expr = NULL;
+    ljob_finish(&f->job);
+}
+
+/**
+ * @brief
+ * This function is the pool task of future: evaluates its expression unless an await already has,
+ * then lets its interpreter know it's done.
+*/
+static void lfuture_run(void* arg) {
+    lfuture_t* f = arg;
+    ljob_t* futures = f->interp.futures;
+    int run = !__atomic_exchange_n(&f->started, 1, __ATOMIC_ACQ_REL);
+    if (run) { lfuture_eval(f); }
+    lfuture_release(f);
+    if (run) { ljob_finish(futures); }
+}
+
+/**
+ * @brief
+ * This function starts evaluating Q-expression on the thread pool and returns Future of its value: (future {expr}).
+ * The expression sees copies of the caller's local bindings as they are now and the live global environment,
+ * def inside it binds in its own environment. Without pool workers (one CPU) the expression is evaluated right away.
+*/
+lval_t* builtin_future(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("future", a, 1);
+    LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+    lfuture_t* f = malloc(sizeof(lfuture_t));
+    f->refs = 2;
+    f->started = 0;
+    f->printed = 0;
+    f->expr = lval_thaw(lval_take(a, 0));
+    f->expr->type = LVAL_SEXPR;
+    f->result = NULL;
+    f->interp = *e->interp;
+    lbuf_init(&f->interp.out);
+    f->interp.out_capture = 1;
+    f->env = lenv_snapshot(e);
+    f->env->boundary = 1;
+    f->env->interp = &f->interp;
+    ljob_init(&f->job, 1);
+    __atomic_add_fetch(&f->interp.futures->remaining, 1, __ATOMIC_ACQ_REL);
+
+    lval_t* v = lval_alloc();
+    v->type = LVAL_FUTURE;
+    v->future = f;
+
+    if (lpool_get()->nworkers == 0) {
+        lfuture_run(f);
+    } else {
+        lpool_submit((ltask_t){lfuture_run, f});
+    }
+    return v;
+}
+
+/**
+ * @brief
+ * This function waits for future and returns copy of its value: (await future). A future no thread has started
+ * is evaluated right here. Otherwise the thread just sleeps, as a task run on top of the awaiting one could wait
+ * for a future beneath it. Output printed by the expression is written by the first await, or when the future
+ * is dropped if none comes.
+*/
+lval_t* builtin_await(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("await", a, 1);
+    LASSERT_TYPE("await", a, 0, LVAL_FUTURE);
+
+    lfuture_t* f = a->cell[0]->future;
+    if (!__atomic_exchange_n(&f->started, 1, __ATOMIC_ACQ_REL)) {
+        lfuture_eval(f);
+        ljob_finish(f->interp.futures);
+    } else {
+        ljob_block(&f->job);
+    }
+    if (__atomic_exchange_n(&f->printed, 1, __ATOMIC_ACQ_REL) == 0) {
+        lout_write(e->interp, f->interp.out.data, f->interp.out.len);
+    }
+    lval_t* res = lval_copy(f->result);
+    lval_del(a);
+    return res;
+}
+
+lmailbox_t* lmailbox_new(void) {
+    lmailbox_t* m = malloc(sizeof(lmailbox_t));
+    m->refs = 1;
+    m->receiving = 0;
+    m->sleeping = 0;
+    m->stub.next = NULL;
+    m->stub.v = NULL;
+    m->head = &m->stub;
+    m->tail = &m->stub;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->wake, NULL);
+    return m;
+}
+
+//This function drops one reference to mailbox, deleting it and messages nobody received with the last one.
+void lmailbox_release(lmailbox_t* m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    lmsg_t* msg = m->tail;
+    while (msg) {
+        lmsg_t* next = msg->next;
+        if (msg != &m->stub) {
+            lval_del(msg->v);
+            free(msg);
+        }
+        msg = next;
+    }
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->wake);
+    free(m);
+}
+
+//This function links message as the newest one, any thread may call it.
+static void lmailbox_push(lmailbox_t* m, lmsg_t* msg) {
+    msg->next = NULL;
+    lmsg_t* prev = __atomic_exchange_n(&m->head, msg, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief
+ * This function unlinks the oldest message, only the receiver may call it. Returns NULL if there is none,
+ * or if a sender has swapped its message in but not linked it yet; it wakes the receiver when it's done.
+*/
+static lmsg_t* lmailbox_pop(lmailbox_t* m) {
+    lmsg_t* tail = m->tail;
+    lmsg_t* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &m->stub) {
+        if (!next) { return NULL; }
+        m->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        m->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&m->head, __ATOMIC_ACQUIRE)) { return NULL; }
+
+    /* tail is the last message, put the stub behind it so tail can be taken */
+    lmailbox_push(m, &m->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        m->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * @brief
+ * This function queues value to mailbox, taking it over, and wakes the receiver if it sleeps.
+ * The fence orders the push before reading sleeping, as the receiver's store of sleeping is before its pop;
+ * otherwise both could see the old value of the other's write and the message would wait for the next one.
+*/
+void lmailbox_send(lmailbox_t* m, lval_t* v) {
+    lmsg_t* msg = malloc(sizeof(lmsg_t));
+    msg->v = v;
+    lmailbox_push(m, msg);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&m->lock);
+        pthread_cond_signal(&m->wake);
+        pthread_mutex_unlock(&m->lock);
+    }
+}
+
+/**
+ * @brief
+ * This function takes the oldest value from mailbox, sleeping until one comes but at most ms milliseconds
+ * (no limit if ms is negative). Returns NULL on timeout. Only one thread may receive at a time.
+*/
+lval_t* lmailbox_receive(lmailbox_t* m, long ms) {
+    struct timespec deadline;
+    if (ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ms / 1000 + (deadline.tv_nsec + (ms % 1000) * 1000000) / 1000000000;
+        deadline.tv_nsec = (deadline.tv_nsec + (ms % 1000) * 1000000) % 1000000000;
+    }
+
+    lmsg_t* msg;
+    int timeout = 0;
+    while (!(msg = lmailbox_pop(m)) && !timeout) {
+        pthread_mutex_lock(&m->lock);
+        __atomic_store_n(&m->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!(msg = lmailbox_pop(m))) {
+            if (ms < 0) {
+                pthread_cond_wait(&m->wake, &m->lock);
+            } else {
+                timeout = pthread_cond_timedwait(&m->wake, &m->lock, &deadline) == ETIMEDOUT;
+            }
+        }
+        __atomic_store_n(&m->sleeping, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&m->lock);
+        if (msg) { break; }
+    }
+    if (!msg) { return NULL; }
+    lval_t* v = msg->v;
+    free(msg);
+    return v;
+}
+
+//This function creates Isolate value referring to mailbox.
+static lval_t* lval_isolate(lmailbox_t* m) {
+    lval_t* v = lval_alloc();
+    v->type = LVAL_ISOLATE;
+    v->mailbox = m;
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    return v;
+}
+
+/**
+ * @brief
+ * This function returns the first handle in value which only works on the thread that made it: File, Future,
+ * Task or Generator, looking into lists and lambdas. Returns NULL if there is none.
+*/
+static lval_t* lval_find_handle(lval_t* v) {
+    lval_t* h = NULL;
+    switch (v->type) {
+        case LVAL_FILE:
+        case LVAL_FUTURE:
+        case LVAL_TASK:
+        case LVAL_GEN:
+            return v;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for (int i = 0; i < v->count && !h; i++) { h = lval_find_handle(v->cell[i]); }
+            return h;
+        case LVAL_FUN:
+            if (v->builtin) { return NULL; }
+            for (int i = 0; i < v->env->count && !h; i++) { h = lval_find_handle(v->env->vals[i]); }
+            return h;
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * @brief
+ * This function copies bindings of environment into global environment of another interpreter.
+ * Returns error naming the first binding holding a handle, which the other thread couldn't use, or NULL.
+*/
+static lval_t* lenv_put_all(lenv_t* to, lenv_t* from) {
+    lval_t* err = NULL;
+    if (from->lock) { pthread_rwlock_rdlock(from->lock); }
+    for (int i = 0; i < from->count; i++) {
+        lval_t* h = lval_find_handle(from->vals[i]);
+        if (h) {
+            err = lval_err("Function 'spawn' cannot copy %s in '%s' to isolate.", ltype_name(h->type), from->syms[i]);
+            break;
+        }
+        lval_t* k = lval_sym(from->syms[i]);
+        lenv_put(to, k, from->vals[i]);
+        lval_del(k);
+    }
+    if (from->lock) { pthread_rwlock_unlock(from->lock); }
+    return err;
+}
+
+//This function binds self to the isolate of interpreter, the main program is one too.
+static void lenv_put_self(linterp_t* it) {
+    lval_t* k = lval_sym("self");
+    lval_t* v = lval_isolate(it->mailbox);
+    lenv_put(it->env, k, v);
+    lval_del(k);
+    lval_del(v);
+}
+
+//This function runs isolate: evaluates its expression, prints an error it ends with and deletes its interpreter.
+static void* lisolate_main(void* arg) {
+    lisolate_t* iso = arg;
+    linterp_t* it = iso->interp;
+    lval_t* res = lval_eval(it->env, iso->expr);
+    if (res->type == LVAL_ERR) { lval_println(it, res); }
+    lval_del(res);
+    linterp_del(it);
+    free(iso);
+    return NULL;
+}
+
+/**
+ * @brief
+ * This function starts isolate evaluating Q-expression and returns it: (spawn {expr}). Isolate is a separate
+ * interpreter on its own thread, it starts with copies of the caller's global and local bindings; self is bound
+ * to the isolate in them. Only Isolate values and immutable string buffers are shared, bindings holding File,
+ * Future, Task or Generator handles are refused. Isolates talk with send and receive, they end when the program does.
+*/
+lval_t* builtin_spawn(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("spawn", a, 1);
+    LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+
+    linterp_t* it = linterp_new();
+    it->out_file = e->interp->out_file;
+    lval_t* err = lenv_put_all(it->env, e->interp->env);
+    if (!err) {
+        lenv_t* locals = lenv_snapshot(e);
+        err = lenv_put_all(it->env, locals);
+        lenv_del(locals);
+    }
+    if (err) {
+        linterp_del(it);
+        lval_del(a);
+        return err;
+    }
+    lenv_put_self(it);
+
+    lout_flush(e->interp); //Output printed before must come before the isolate's.
+    lisolate_t* iso = malloc(sizeof(lisolate_t));
+    iso->interp = it;
+    iso->expr = lval_thaw(lval_take(a, 0));
+    iso->expr->type = LVAL_SEXPR;
+    lval_t* v = lval_isolate(it->mailbox);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, lisolate_main, iso) != 0) {
+        lval_del(iso->expr);
+        free(iso);
+        linterp_del(it);
+        lval_del(v);
+        return lval_err("Function 'spawn' could not start thread: %s", strerror(errno));
+    }
+    pthread_detach(tid);
+    return v;
+}
+
+/**
+ * @brief
+ * This function sends value to isolate's mailbox: (send isolate value). The value is copied, lists are copied
+ * deeply while immutable string buffers are shared. File, Future, Task and Generator handles can't be sent.
+ * Returns ().
+*/
+lval_t* builtin_send(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("send", a, 2);
+    LASSERT_TYPE("send", a, 0, LVAL_ISOLATE);
+    lval_t* h = lval_find_handle(a->cell[1]);
+    LASSERT(a, !h, "Function 'send' cannot send %s to isolate.", h ? ltype_name(h->type) : "");
+
+    lout_flush(e->interp);
+    lmailbox_send(a->cell[0]->mailbox, lval_pop(a, 1));
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/**
+ * @brief
+ * This function waits for the oldest message sent to this isolate and returns it: (receive ms).
+ * It waits at most ms milliseconds, or without limit if ms is negative; timeout is an error.
+*/
+lval_t* builtin_receive(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("receive", a, 1);
+    LASSERT_TYPE("receive", a, 0, LVAL_NUM);
+    long ms = a->cell[0]->num;
+    lval_del(a);
+
+    lmailbox_t* m = e->interp->mailbox;
+    if (__atomic_exchange_n(&m->receiving, 1, __ATOMIC_ACQUIRE)) {
+        return lval_err("Function 'receive' called while another thread receives messages of this isolate.");
+    }
+    lout_flush(e->interp); //Everything printed must be visible before sleeping.
+    lval_t* v = lmailbox_receive(m, ms);
+    __atomic_store_n(&m->receiving, 0, __ATOMIC_RELEASE);
+    return v ? v : lval_err("Function 'receive' got no message in %li ms.", ms);
+}
+
+__thread lloop_t* lloop = NULL; //Event loop of this thread, made by the first async.
+__thread lcoro_t* lgen_current = NULL; //Generator running on this thread, yield gives its value.
+
+//This function leaves pool of a process made by fork without workers: tasks then run on the waiting thread.
+static void lpool_none(void) {
+    lpool.nworkers = 0;
+}
+
+/**
+ * @brief
+ * This function is called by a child made by fork. Only the forking thread exists in it, so the pool is left
+ * without workers and the event loop, whose epoll instance is shared with the parent, is forgotten.
+*/
+void lfork_reset(void) {
+    pthread_once(&lpool_once, lpool_none);
+    lpool.nworkers = 0;
+    lpool.queued = 0;
+    pthread_mutex_init(&lpool.lock, NULL);
+    pthread_cond_init(&lpool.wake, NULL);
+    lloop = NULL;
+}
+
+//This function returns monotonic time in milliseconds.
+static long long lclock_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+//This function returns event loop of this thread, making it on first use. Returns NULL if epoll isn't available.
+static lloop_t* lloop_get(void) {
+    if (lloop) { return lloop; }
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) { return NULL; }
+    lloop = calloc(1, sizeof(lloop_t));
+    lloop->epfd = epfd;
+    return lloop;
+}
+
+//This function appends coroutine to ready queue of its loop.
+static void lloop_ready(lloop_t* l, lcoro_t* c) {
+    c->state = LCORO_READY;
+    c->next = NULL;
+    if (l->ready_tail) { l->ready_tail->next = c; } else { l->ready = c; }
+    l->ready_tail = c;
+}
+
+/**
+ * @brief
+ * This function resumes generator dropped while paused in yield, which then returns error, so the evaluation
+ * unwinds and frees what it holds. Values taking the generator meanwhile don't release it again (see cancel).
+*/
+static void lgen_cancel(lcoro_t* g) {
+    ucontext_t here;
+    lcoro_t* outer = lgen_current;
+    g->cancel = 1;
+    g->back = &here;
+    g->state = LCORO_RUNNING;
+    lgen_current = g;
+    swapcontext(&here, &g->ctx);
+    lgen_current = outer;
+}
+
+/**
+ * @brief
+ * This function drops one reference to coroutine. Its stack is freed as soon as it finishes, the rest with the last reference.
+ * A generator paused in yield is unwound first, unless it's dropped on another thread than its own.
+*/
+void lcoro_release(lcoro_t* c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    if (c->cancel) { return; } //Copy taken while unwinding, lgen_cancel's caller frees it.
+    if (c->stack && !c->loop && !c->expr && c->state == LCORO_READY && pthread_equal(c->thread, pthread_self())) {
+        lgen_cancel(c);
+    }
+    if (c->stack) { munmap(c->stack, LCORO_STACK_SIZE); }
+    if (c->expr) { lval_del(c->expr); }
+    if (c->result) { lval_del(c->result); }
+    lenv_del(c->env);
+    free(c);
+}
+
+//This function switches from running coroutine back to the loop, it continues when the loop resumes it.
+static void lcoro_suspend(lcoro_t* c) {
+    lcoro_t* g = lgen_current; //Generator running in the coroutine belongs to it, not to the ones run meanwhile.
+    lgen_current = NULL;
+    swapcontext(&c->ctx, &c->loop->main);
+    lgen_current = g;
+}
+
+//This function is the bottom of coroutine stack: evaluates its expression and returns to the loop.
+static void lcoro_main(void) {
+    lcoro_t* c = lloop->current;
+    lval_t* expr = c->expr;
+    c->expr = NULL; //Evaluation takes it over.
+    c->result = lval_eval(c->env, expr);
+    c->state = LCORO_DONE;
+}
+
+/**
+ * @brief
+ * This function waits until file descriptor is ready for events (EPOLLIN or EPOLLOUT). In coroutine it gives way
+ * to other coroutines meanwhile, elsewhere it blocks in poll. Descriptors epoll can't watch count as ready.
+*/
+static void lio_wait(int fd, uint32_t events) {
+    lcoro_t* c = lloop ? lloop->current : NULL;
+    if (!c) {
+        struct pollfd p = {fd, events == EPOLLIN ? POLLIN : POLLOUT, 0};
+        poll(&p, 1, -1);
+        return;
+    }
+
+    /* One descriptor is registered once, other coroutines waiting for it use duplicates */
+    struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = c};
+    int wfd = fd;
+    if (epoll_ctl(lloop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (errno != EEXIST || (wfd = dup(fd)) < 0) { return; }
+        if (epoll_ctl(lloop->epfd, EPOLL_CTL_ADD, wfd, &ev) < 0) {
+            close(wfd);
+            return;
+        }
+    }
+    lloop->waiting_io++;
+    c->state = LCORO_WAITING;
+    lcoro_suspend(c);
+    epoll_ctl(lloop->epfd, EPOLL_CTL_DEL, wfd, NULL);
+    if (wfd != fd) { close(wfd); }
+}
+
+//This function resumes coroutine until it waits or finishes. Finished one wakes its waiters and loses its stack.
+static void lloop_step(lloop_t* l, lcoro_t* c) {
+    lcoro_t* g = lgen_current; //A generator awaiting io doesn't own the tasks run meanwhile.
+    lgen_current = NULL;
+    l->current = c;
+    swapcontext(&l->main, &c->ctx);
+    l->current = NULL;
+    lgen_current = g;
+    if (c->state != LCORO_DONE) { return; }
+
+    while (c->waiters) {
+        lcoro_t* w = c->waiters;
+        c->waiters = w->wnext;
+        lloop_ready(l, w);
+    }
+    munmap(c->stack, LCORO_STACK_SIZE);
+    c->stack = NULL;
+    lcoro_release(c); //Reference held while it ran.
+}
+
+/**
+ * @brief
+ * This function runs the first ready coroutine of loop, or if there is none, waits in epoll for descriptors
+ * and the earliest sleeper and makes those ready. Returns 0 if nothing is left to wait for.
+*/
+static int lloop_turn(lloop_t* l) {
+    struct epoll_event evs[LLOOP_MAX_EVENTS];
+    if (l->ready) {
+        lcoro_t* c = l->ready;
+        l->ready = c->next;
+        if (!l->ready) { l->ready_tail = NULL; }
+        lloop_step(l, c);
+        return 1;
+    }
+    if (!l->sleepers && l->waiting_io == 0) { return 0; }
+
+    long long now = lclock_ms();
+    int timeout = -1;
+    for (lcoro_t* s = l->sleepers; s; s = s->next) {
+        long long left = s->wake_at > now ? s->wake_at - now : 0;
+        if (timeout < 0 || left < timeout) { timeout = (int)left; }
+    }
+    int n = epoll_wait(l->epfd, evs, LLOOP_MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+        l->waiting_io--;
+        lloop_ready(l, evs[i].data.ptr);
+    }
+
+    /* Wake sleepers whose time has come */
+    now = lclock_ms();
+    lcoro_t** link = &l->sleepers;
+    while (*link) {
+        lcoro_t* s = *link;
+        if (s->wake_at <= now) {
+            *link = s->next;
+            lloop_ready(l, s);
+        } else {
+            link = &s->next;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief
+ * This function runs coroutines of loop until task finishes (see lloop_turn).
+ * Returns 0 if nothing is left that could finish the task.
+*/
+static int lloop_run(lloop_t* l, lcoro_t* task) {
+    while (task->state != LCORO_DONE) {
+        if (!lloop_turn(l)) { return 0; }
+    }
+    return 1;
+}
+
+/**
+ * @brief
+ * This function locks file for one operation. A coroutine may wait in its event loop while holding the lock,
+ * so instead of blocking the thread that coroutine needs, another coroutine of the thread waits in the loop
+ * until the holder unlocks, and code outside coroutines runs the loop meanwhile. Other threads simply wait.
+ * Waiters are only added and woken on the holder's thread, so they need no lock of their own.
+*/
+static void lfile_lock(lfile_t* f) {
+    lloop_t* l = lloop;
+    while (pthread_mutex_trylock(&f->lock) != 0) {
+        if (!l || __atomic_load_n(&f->holder, __ATOMIC_RELAXED) != l) {
+            pthread_mutex_lock(&f->lock);
+            break;
+        }
+        lcoro_t* c = l->current;
+        if (c) {
+            c->wnext = f->waiters;
+            f->waiters = c;
+            c->state = LCORO_WAITING;
+            lcoro_suspend(c);
+        } else {
+            lloop_turn(l);
+        }
+    }
+    __atomic_store_n(&f->holder, l && l->current ? l : NULL, __ATOMIC_RELAXED);
+}
+
+//This function unlocks file locked by lfile_lock, making coroutines waiting for it ready.
+static void lfile_unlock(lfile_t* f) {
+    lloop_t* l = f->holder;
+    while (f->waiters) {
+        lcoro_t* w = f->waiters;
+        f->waiters = w->wnext;
+        lloop_ready(l, w);
+    }
+    __atomic_store_n(&f->holder, NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/**
+ * @brief
+ * This function starts coroutine evaluating Q-expression and returns its Task: (async {expr}). Coroutines of a
+ * thread take turns on it: they run while await-io waits outside of them, and each runs until it waits
+ * for a file, sleep or another task. The expression sees copies of the caller's local bindings and the global environment.
+*/
+lval_t* builtin_async(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("async", a, 1);
+    LASSERT_TYPE("async", a, 0, LVAL_QEXPR);
+    lloop_t* l = lloop_get();
+    LASSERT(a, l, "Function 'async' could not make event loop: %s", strerror(errno));
+
+    char* stack = mmap(NULL, LCORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    LASSERT(a, stack != MAP_FAILED, "Function 'async' could not allocate stack: %s", strerror(errno));
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE); //Guard page, overflow faults instead of corrupting memory.
+
+    lcoro_t* c = calloc(1, sizeof(lcoro_t));
+    c->refs = 2; //Task value and the loop until it finishes.
+    c->stack = stack;
+    c->loop = l;
+    c->expr = lval_thaw(lval_take(a, 0));
+    c->expr->type = LVAL_SEXPR;
+    c->env = lenv_snapshot(e);
+
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = stack;
+    c->ctx.uc_stack.ss_size = LCORO_STACK_SIZE;
+    c->ctx.uc_link = &l->main;
+    makecontext(&c->ctx, lcoro_main, 0);
+    lloop_ready(l, c);
+
+    lval_t* v = lval_alloc();
+    v->type = LVAL_TASK;
+    v->task = c;
+    return v;
+}
+
+/**
+ * @brief
+ * This function waits for task and returns copy of its value: (await-io task). In coroutine it gives way to others,
+ * elsewhere it runs the event loop until the task finishes.
+*/
+lval_t* builtin_await_io(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("await-io", a, 1);
+    LASSERT_TYPE("await-io", a, 0, LVAL_TASK);
+    lcoro_t* t = a->cell[0]->task;
+    LASSERT(a, t->loop == lloop, "Function 'await-io' passed task of another thread.");
+
+    lcoro_t* c = lloop->current;
+    if (t->state != LCORO_DONE) {
+        if (c) {
+            LASSERT(a, c != t, "Function 'await-io' passed the task it's called in.");
+            c->wnext = t->waiters;
+            t->waiters = c;
+            c->state = LCORO_WAITING;
+            lcoro_suspend(c);
+        } else if (!lloop_run(lloop, t)) {
+            lval_del(a);
+            return lval_err("Function 'await-io' passed task which waits forever.");
+        }
+    }
+
+    lval_t* res = lval_copy(t->result);
+    lval_del(a);
+    return res;
+}
+
+//This function pauses for ms milliseconds: (sleep ms). In coroutine other coroutines run meanwhile. Returns ().
+lval_t* builtin_sleep(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("sleep", a, 1);
+    LASSERT_TYPE("sleep", a, 0, LVAL_NUM);
+    long ms = a->cell[0]->num;
+    lval_del(a);
+
+    lcoro_t* c = lloop ? lloop->current : NULL;
+    if (c) {
+        c->wake_at = lclock_ms() + ms;
+        c->next = lloop->sleepers;
+        lloop->sleepers = c;
+        c->state = LCORO_WAITING;
+        lcoro_suspend(c);
+    } else if (ms > 0) {
+        struct timespec t = {ms / 1000, (ms % 1000) * 1000000};
+        while (nanosleep(&t, &t) < 0 && errno == EINTR) {}
+    }
+    return lval_sexpr();
+}
+
+//This function is the bottom of generator stack: evaluates its expression and switches back for good.
+static void lgen_main(void) {
+    lcoro_t* g = lgen_current;
+    lval_t* expr = g->expr;
+    g->expr = NULL; //Evaluation takes it over.
+    lval_t* res = lval_eval(g->env, expr);
+    if (g->result) { lval_del(g->result); }
+    g->result = res; //Only an error is returned by next, other values are dropped.
+    g->state = LCORO_DONE;
+    setcontext(g->back);
+}
+
+/**
+ * @brief
+ * This function makes generator of Q-expression: (gen {expr}). The expression runs on its own stack only
+ * while next resumes it, and each yield in it (also in functions it calls) pauses it and hands a value to next.
+ * So sequences are produced one element at a time. A generator dropped while paused is resumed once more with
+ * yield returning error, so its evaluation unwinds and frees what it holds; infinite generators cost nothing
+ * once dropped. The expression sees copies of the caller's local bindings and the global environment.
+ * Only the thread which made the generator may resume it.
+*/
+lval_t* builtin_gen(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("gen", a, 1);
+    LASSERT_TYPE("gen", a, 0, LVAL_QEXPR);
+
+    char* stack = mmap(NULL, LCORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    LASSERT(a, stack != MAP_FAILED, "Function 'gen' could not allocate stack: %s", strerror(errno));
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+    lcoro_t* g = calloc(1, sizeof(lcoro_t));
+    g->refs = 1;
+    g->stack = stack;
+    g->state = LCORO_READY;
+    g->expr = lval_thaw(lval_take(a, 0));
+    g->expr->type = LVAL_SEXPR;
+    g->env = lenv_snapshot(e);
+    g->thread = pthread_self();
+
+    getcontext(&g->ctx);
+    g->ctx.uc_stack.ss_sp = stack;
+    g->ctx.uc_stack.ss_size = LCORO_STACK_SIZE;
+    g->ctx.uc_link = NULL;
+    makecontext(&g->ctx, lgen_main, 0);
+
+    lval_t* v = lval_alloc();
+    v->type = LVAL_GEN;
+    v->gen = g;
+    return v;
+}
+
+//This function hands value to next and pauses generator it's called in until next resumes it: (yield value). Returns ().
+lval_t* builtin_yield(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("yield", a, 1);
+    lcoro_t* g = lgen_current;
+    LASSERT(a, g, "Function 'yield' called outside of generator.");
+    LASSERT(a, !g->cancel, "Function 'yield' called in generator which was dropped.");
+
+    if (g->result) { lval_del(g->result); }
+    g->result = lval_take(a, 0);
+    g->state = LCORO_READY;
+    swapcontext(&g->ctx, g->back);
+    return g->cancel ? lval_err("Function 'yield' called in generator which was dropped.") : lval_sexpr();
+}
+
+/**
+ * @brief
+ * This function resumes generator until its next yield: (next generator). Returns {value} of the yield,
+ * {} when the generator has finished, or the error it finished with.
+*/
+lval_t* builtin_next(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("next", a, 1);
+    LASSERT_TYPE("next", a, 0, LVAL_GEN);
+    lcoro_t* g = a->cell[0]->gen;
+    LASSERT(a, pthread_equal(g->thread, pthread_self()), "Function 'next' passed generator of another thread.");
+    LASSERT(a, g->state != LCORO_RUNNING, "Function 'next' passed generator which is running.");
+    if (g->state == LCORO_DONE) {
+        lval_del(a);
+        return lval_qexpr();
+    }
+
+    ucontext_t here;
+    lcoro_t* outer = lgen_current;
+    g->back = &here;
+    g->state = LCORO_RUNNING;
+    lgen_current = g;
+    swapcontext(&here, &g->ctx);
+    lgen_current = outer;
+
+    lval_t* v = g->result;
+    g->result = NULL;
+    if (g->state != LCORO_DONE) {
+        v = lval_add(lval_qexpr(), v);
+    } else {
+        munmap(g->stack, LCORO_STACK_SIZE);
+        g->stack = NULL;
+        if (v->type != LVAL_ERR) {
+            lval_del(v);
+            v = lval_qexpr();
+        }
+    }
+    lval_del(a);
+    return v;
+}
+
+//This function returns its argument frozen: (freeze value). See lval_freeze.
+lval_t* builtin_freeze(lenv_t* e, lval_t* a) {
+    LASSERT_NUM("freeze", a, 1);
+    lval_t* v = lval_take(a, 0);
+    lval_freeze(v);
+    return v;
+}
+
+/* Embedding API, see lisp.h */
+
+_Static_assert(LISP_STR == (int)LVAL_STR && LISP_GEN == (int)LVAL_GEN, "lisp_type_t must follow var_t");
+
+lisp_t* lisp_new(void) {
+    return linterp_new();
+}
+
+void lisp_free(lisp_t* lisp) {
+    linterp_del(lisp);
+}
+
+//This function evaluates forms of source in order and returns result of the last one, or the first error.
+lisp_value_t* lisp_eval(lisp_t* lisp, const char* src) {
+    uint32_t file = lsrc_register_text("<eval>", src, strlen(src));
+    lval_t* forms = lval_parse_string(lisp, "<eval>", src, file, 0);
+    if (forms->type == LVAL_ERR) { return forms; }
+
+    lval_t* res = lval_sexpr();
+    int i = 0;
+    while (i < forms->count && res->type != LVAL_ERR) {
+        lval_del(res);
+        res = lval_eval(lisp->env, forms->cell[i++]);
+    }
+
+    /* Forms after an error are not evaluated */
+    for (; i < forms->count; i++) { lval_del(forms->cell[i]); }
+    forms->count = 0;
+    lval_del(forms);
+    return res;
+}
+
+//This function binds native function to name in global environment.
+void lisp_define(lisp_t* lisp, const char* name, lisp_builtin_t fn) {
+    lenv_add_builtin(lisp->env, (char*)name, fn);
+}
+
+//This function binds copy of value to name in global environment.
+void lisp_set(lisp_t* lisp, const char* name, lisp_value_t* v) {
+    lval_t* k = lval_sym((char*)name);
+    lenv_put(lisp->env, k, v);
+    lval_del(k);
+}
+
+//This function returns copy of value bound to name in global environment, or error if unbound.
+lisp_value_t* lisp_get(lisp_t* lisp, const char* name) {
+    lval_t* k = lval_sym((char*)name);
+    lval_t* v = lenv_get(lisp->env, k);
+    lval_del(k);
+    return v;
+}
+
+//This function sets where output of print goes, stdout by default.
+void lisp_set_output(lisp_t* lisp, FILE* f) {
+    lout_flush(lisp);
+    lisp->out_file = f;
+}
+
+void lisp_flush(lisp_t* lisp) {
+    lout_flush(lisp);
+}
+
+//This function returns malloc'ed printed form of value, as the REPL would show it.
+char* lisp_print(lisp_t* lisp, lisp_value_t* v) {
+    lbuf_t saved = lisp->out;
+    int capture = lisp->out_capture;
+    lbuf_init(&lisp->out);
+    lisp->out_capture = 1;
+
+    lprint_opts_t opts;
+    lprint_opts_get(lisp->env, &opts);
+    lval_print_opts(lisp, v, &opts);
+    lbuf_putc(&lisp->out, '\0');
+
+    char* res = lisp->out.data;
+    lisp->out = saved;
+    lisp->out_capture = capture;
+    return res;
+}
+
+lisp_value_t* lisp_num(long x) {
+    return lval_num(x);
+}
+
+lisp_value_t* lisp_float(double x) {
+    return lval_float(x);
+}
+
+lisp_value_t* lisp_str(const char* s, size_t n) {
+    return lval_str_len(s, n);
+}
+
+lisp_value_t* lisp_err(const char* msg) {
+    return lval_err("%s", msg);
+}
+
+//This function returns new empty Q-expression.
+lisp_value_t* lisp_list(void) {
+    return lval_qexpr();
+}
+
+//This function appends value to list, taking it over. Returns the list.
+lisp_value_t* lisp_push(lisp_value_t* list, lisp_value_t* v) {
+    return lval_add(list, v);
+}
+
+lisp_value_t* lisp_value_copy(lisp_value_t* v) {
+    return lval_copy(v);
+}
+
+void lisp_value_free(lisp_value_t* v) {
+    lval_del(v);
+}
+
+lisp_type_t lisp_type(lisp_value_t* v) {
+    return (lisp_type_t)v->type;
+}
+
+//This function returns number value, floats are truncated, other types give 0.
+long lisp_to_num(lisp_value_t* v) {
+    if (v->type == LVAL_NUM) { return v->num; }
+    if (v->type == LVAL_FLOAT) { return (long)v->dnum; }
+    return 0;
+}
+
+//This function returns float value, numbers are converted, other types give 0.
+double lisp_to_float(lisp_value_t* v) {
+    if (v->type == LVAL_FLOAT) { return v->dnum; }
+    if (v->type == LVAL_NUM) { return (double)v->num; }
+    return 0;
+}
+
+/**
+ * @brief
+ * This function returns text of string, symbol or error (NULL for other types), valid while the value lives.
+ * Length is stored in n if it's not NULL; strings may contain NUL bytes.
+*/
+const char* lisp_to_str(lisp_value_t* v, size_t* n) {
+    const char* s;
+    switch (v->type) {
+        case LVAL_STR: s = lval_str_cstr(v); break;
+        case LVAL_SYM: s = v->sym; break;
+        case LVAL_ERR: s = v->err; break;
+        default: return NULL;
+    }
+    if (n) { *n = v->type == LVAL_STR ? v->len : strlen(s); }
+    return s;
+}
+
+//This function returns number of elements of S-expression or Q-expression, 0 for other types.
+int lisp_count(lisp_value_t* v) {
+    return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) ? v->count : 0;
+}
+
+//This function returns element i of list (owned by the list) or NULL if out of range.
+lisp_value_t* lisp_at(lisp_value_t* v, int i) {
+    return (i >= 0 && i < lisp_count(v)) ? v->cell[i] : NULL;
+}
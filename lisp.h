@@ -0,0 +1,76 @@
+/**
+ * @file lisp.h
+ * @brief C API for embedding TinyLisp interpreter (liblisp.a / liblisp.so).
+ *
+ * @details
+ * Every interpreter is independent, different interpreters may be used on different threads at once,
+ * one interpreter must be used by one thread at a time.
+ * Values returned by the API are owned by the caller and are freed with lisp_value_free,
+ * unless said otherwise. Values passed to the API are not taken over, unless said otherwise.
+ */
+
+#ifndef LISP_H
+#define LISP_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(LISP_LIBRARY) && defined(__GNUC__)
+#define LISP_API __attribute__((visibility("default")))
+#else
+#define LISP_API
+#endif
+
+typedef struct linterp lisp_t;
+typedef struct lenv lisp_env_t;
+typedef struct lval lisp_value_t;
+
+/**
+ * @brief
+ * Native builtin. Gets environment of the call and S-expression of evaluated arguments, which it owns
+ * and must free. Returns result; errors are returned as values made by lisp_err.
+*/
+typedef lisp_value_t* (*lisp_builtin_t)(lisp_env_t* env, lisp_value_t* args);
+
+//Value types, numbering is stable.
+typedef enum lisp_type {
+    LISP_NUM, LISP_FLOAT, LISP_ERR, LISP_SYM, LISP_SEXPR, LISP_QEXPR, LISP_FUN, LISP_STR, LISP_FILE, LISP_FUTURE, LISP_ISOLATE, LISP_TASK, LISP_GEN
+} lisp_type_t;
+
+/* Interpreter */
+LISP_API lisp_t* lisp_new(void);
+LISP_API void lisp_free(lisp_t* lisp);
+LISP_API lisp_value_t* lisp_eval(lisp_t* lisp, const char* src);
+LISP_API void lisp_define(lisp_t* lisp, const char* name, lisp_builtin_t fn);
+LISP_API void lisp_set(lisp_t* lisp, const char* name, lisp_value_t* v);
+LISP_API lisp_value_t* lisp_get(lisp_t* lisp, const char* name);
+LISP_API void lisp_set_output(lisp_t* lisp, FILE* f);
+LISP_API void lisp_flush(lisp_t* lisp);
+LISP_API char* lisp_print(lisp_t* lisp, lisp_value_t* v);
+
+/* Values */
+LISP_API lisp_value_t* lisp_num(long x);
+LISP_API lisp_value_t* lisp_float(double x);
+LISP_API lisp_value_t* lisp_str(const char* s, size_t n);
+LISP_API lisp_value_t* lisp_err(const char* msg);
+LISP_API lisp_value_t* lisp_list(void);
+LISP_API lisp_value_t* lisp_push(lisp_value_t* list, lisp_value_t* v);
+LISP_API lisp_value_t* lisp_value_copy(lisp_value_t* v);
+LISP_API void lisp_value_free(lisp_value_t* v);
+
+LISP_API lisp_type_t lisp_type(lisp_value_t* v);
+LISP_API long lisp_to_num(lisp_value_t* v);
+LISP_API double lisp_to_float(lisp_value_t* v);
+LISP_API const char* lisp_to_str(lisp_value_t* v, size_t* n);
+LISP_API int lisp_count(lisp_value_t* v);
+LISP_API lisp_value_t* lisp_at(lisp_value_t* v, int i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif